@@ -1,11 +1,17 @@
 #/bin/sh
+FPGADIR=/sys/kernel/debug/fpga
 if [ $# -eq 1 ] 
 then
 	echo "Downloading "$1" to fpga"
-	cat $1 > /sys/kernel/debug/fpga/data
-	echo 1 > /sys/kernel/debug/fpga/download
-	echo "done" 	
+	cat $1 > $FPGADIR/data || exit 1
+	echo 1 > $FPGADIR/download || exit 1
+	# the download runs in the background; wait for it to leave "running"
+	while grep -q "state=running" $FPGADIR/status
+	do
+		sleep 0.1
+	done
+	cat $FPGADIR/status
+	grep -q "state=done" $FPGADIR/status
 else
 	echo "Usage:fpga_config.sh file_name"
 fi
-
@@ -35,9 +35,23 @@
 #include <linux/spinlock.h>//for use spinlock
 #include <linux/sched.h>
 #include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/jiffies.h>
+#include <linux/kfifo.h>
+#include <linux/ktime.h>
+#include <linux/firmware.h>
+#include <linux/platform_device.h>
+#include <linux/percpu.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/delay.h>
 #include <mach/gpio.h>
 #include <linux/of_irq.h>
 
+#include "lophilo.h"
+
 
 // from linux/arch/arm/mach-at91/board-tabby.c
 extern void __iomem *fpga_cs0_base;
@@ -45,34 +59,202 @@ extern void __iomem *fpga_cs1_base;
 extern void __iomem *fpga_cs2_base;
 extern void __iomem *fpga_cs3_base;
 
+#define MAX_BOARDS 2
 #define MAX_SUBSYSTEMS 32
 #define MAX_REGISTRY_SIZE PAGE_SIZE*4
 #define MAX_PARENT_NAME 32
 #define MAX_IO_NAME 5 // ioXX\0
+#define MAX_DIR_NAME 16 // lophiloN\0
+#define MAX_EINT 8
+#define MAX_BITOPS 2 // dout, doe
+#define MAX_BATCH_OPS 32
+#define MAX_CHANNEL_REGS (32 + MAX_SUBSYSTEMS * 36) // register files per board
 
 #define GPIO_SUBSYSTEM 0xea680001
 #define PWM_SUBSYSTEM 0xea680002
 
 #define SYS_PHYS_ADDR 0x10000000
 #define MOD_PHYS_ADDR 0x20000000
+#define SYS1_PHYS_ADDR 0x30000000
+#define MOD1_PHYS_ADDR 0x40000000
+
+#define PIN_NONE -1
 
 #define SYS_SUBSYSTEM_ID       0
 #define MOD_SUBSYSTEM_ID       1
 #define FPGA_DATA_ID           2
 #define FPGA_DOWNLOAD_ID       3
-#define IRQ_0_ID               4
-#define IRQ_1_ID               5
-#define IRQ_2_ID               6
-#define IRQ_3_ID               7
-#define IRQ_4_ID               8
-#define IRQ_5_ID               9
-#define IRQ_6_ID               10
-#define IRQ_7_ID               11
 
 #define FPGA_DOWNLOAD_BUFFER_SIZE 500*1024
+#define FPGA_STATUS_SIZE 128
+#define EINT_COUNT_SIZE 16
+#define EINT_STATS_SIZE 256
+
+#define EINT_MODE_EVENTS 0
+#define EINT_MODE_COUNTER 1
+
+#define MAX_TELEMETRY_REGS 256
+#define TELEMETRY_FIFO_SIZE 1024*sizeof(struct lophilo_delta)
+#define TELEMETRY_LINE_SIZE 64
+
+#define MAX_LEDFX_FRAMES 256
+#define LEDFX_MAX_RATE 1000 // timer steps per second, fps * (fade + 1)
+
+static unsigned int fpga_timeout_ms = 30000;
+module_param(fpga_timeout_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(fpga_timeout_ms, "Abort an FPGA download after this many milliseconds");
+
+static unsigned int nr_boards = 1;
+module_param(nr_boards, uint, S_IRUGO);
+MODULE_PARM_DESC(nr_boards, "Number of grid FPGAs on the carrier (1-2)");
+
+static char *firmware[MAX_BOARDS];
+module_param_array(firmware, charp, NULL, S_IRUGO);
+MODULE_PARM_DESC(firmware, "Bitstream per board to load from /lib/firmware before discovery");
+
+static unsigned int trace_records;
+module_param(trace_records, uint, S_IRUGO);
+MODULE_PARM_DESC(trace_records, "Register write trace ring size per CPU, 0 disables tracing");
+
+/* Pins wired to one FPGA's passive serial configuration interface */
+struct fpga_pins {
+	int grid_reset;
+	int conf;
+	int dclk;
+	int data;
+	int done;
+	int stat;
+};
+
+/*
+ * Where one grid FPGA lives on the carrier: its sys/mod chip selects and
+ * the SoC pins for configuration and external interrupts.
+ */
+struct board_desc {
+	void __iomem **sys_base;
+	void __iomem **mod_base;
+	u32 sys_paddr;
+	u32 mod_paddr;
+	struct fpga_pins fpga;
+	int eint[MAX_EINT];
+	int nr_eint;
+};
+
+static const struct board_desc board_descs[MAX_BOARDS] = {
+	{
+		.sys_base = &fpga_cs0_base,
+		.mod_base = &fpga_cs1_base,
+		.sys_paddr = SYS_PHYS_ADDR,
+		.mod_paddr = MOD_PHYS_ADDR,
+		.fpga = {
+			.grid_reset = AT91_PIN_PA27,
+			.conf = AT91_PIN_PB16,
+			.dclk = AT91_PIN_PB17,
+			.data = AT91_PIN_PB15,
+			.done = AT91_PIN_PB14,
+			.stat = AT91_PIN_PB18,
+		},
+		.eint = {
+			AT91_PIN_PD10,	//M1-EINT0
+			AT91_PIN_PD11,	//M1-EINT1
+			AT91_PIN_PD13,	//M1-EINT2
+			AT91_PIN_PD14,	//M1-EINT3
+			AT91_PIN_PD17,	//M1-EINT4
+			AT91_PIN_PD18,	//M1-EINT5
+			AT91_PIN_PD19,	//M1-EINT6
+			AT91_PIN_PB0,	//M1-EINT7
+		},
+		.nr_eint = 8,
+	},
+	{
+		// second grid on CS2/CS3; its configuration and interrupt
+		// lines are not routed on the Tabby carrier
+		.sys_base = &fpga_cs2_base,
+		.mod_base = &fpga_cs3_base,
+		.sys_paddr = SYS1_PHYS_ADDR,
+		.mod_paddr = MOD1_PHYS_ADDR,
+		.fpga = {
+			.grid_reset = PIN_NONE,
+			.conf = PIN_NONE,
+			.dclk = PIN_NONE,
+			.data = PIN_NONE,
+			.done = PIN_NONE,
+			.stat = PIN_NONE,
+		},
+		.nr_eint = 0,
+	},
+};
+
+enum fpga_state {
+	FPGA_STATE_IDLE,
+	FPGA_STATE_RUNNING,
+	FPGA_STATE_DONE,
+	FPGA_STATE_FAILED,
+	FPGA_STATE_TIMEOUT,
+	FPGA_STATE_CANCELLED,
+};
+
+static const char *fpga_state_names[] = {
+	"idle", "running", "done", "failed", "timeout", "cancelled"
+};
+
+/*
+ * Download engine: fpga/data fills the buffer, fpga/download queues the
+ * bitstream on fpga_wq and returns, fpga/status reports progress and
+ * becomes readable (poll) once the load has finished.
+ */
+struct fpga_loader {
+	struct work_struct work;
+	struct mutex lock;		/* buffer, length and state */
+	wait_queue_head_t wait;
+	const struct fpga_pins *pins;
+	char *buffer;
+	const struct firmware *firmware;	/* shifted instead of buffer */
+	int length;
+	enum fpga_state state;
+	int result;
+	int bytes;			/* shifted so far */
+	int cancel;
+	unsigned long start;		/* jiffies */
+	unsigned long end;
+};
+
+/* shared by every board; WQ_UNBOUND lets their downloads run in parallel */
+static struct workqueue_struct *fpga_wq;
+
+struct lophilo_board;
+struct subsystem;
+
+/* Register exposed through <name>_set, <name>_clr and <name>_tgl */
+struct bitop_reg {
+	struct subsystem *subsystem;
+	u32 vaddr;
+};
 
-static char* fpga_download_buffer   = NULL;
-static int   fpga_buffer_index      = 0;
+/* Register exposed as a plain hex file, e.g. gpio0/dout */
+struct channel_reg {
+	struct subsystem *subsystem;
+	u32 vaddr;
+	u8 width;
+};
+
+/*
+ * Per-CPU register write trace. lophilo_modify appends with interrupts
+ * off, so each ring has one producer and no lock; readers of trace/data
+ * serialize on trace_lock. A full ring drops new records and counts them
+ * instead of overwriting ones the reader has not seen.
+ */
+struct trace_ring {
+	u32 head;
+	u32 tail;
+	u32 dropped;
+	struct lophilo_trace_record *records;
+};
+
+static struct trace_ring __percpu *trace_rings;
+static u32 trace_size;			/* records per ring, power of two */
+static u32 trace_enabled;
+static DEFINE_MUTEX(trace_lock);
 
 struct subsystem {
 	u32 id;
@@ -82,8 +264,136 @@ struct subsystem {
 	u32 index;
 	u32 paddr;
 	u8 opened;
+	struct lophilo_board *board;
+	spinlock_t lock;	/* serializes read-modify-write of its registers */
+	struct bitop_reg bitops[MAX_BITOPS];
+	u8 nr_bitops;
+};
+
+/* Last, shortest and longest of a measured interval in ns; min is 0 until the first */
+struct eint_interval {
+	u64 last;
+	u64 min;
+	u64 max;
+};
+
+/*
+ * External interrupt line. The handler only bumps count; each open EINTn
+ * file remembers the count it last returned, so readers never miss or
+ * double-report an edge and can multiplex lines with poll/epoll.
+ *
+ * In counter mode the handler wakes nobody and instead times the edges:
+ * the period from rising edge to rising edge and the width of the high
+ * pulse, read back at leisure from EINTn_stats.
+ */
+struct eint_line {
+	int id;
+	int pin;
+	int requested;
+	wait_queue_head_t wait;
+	unsigned int count;
+	u32 mode;			/* EINT_MODE_* */
+	spinlock_t lock;		/* counter mode statistics */
+	u64 reset;			/* when the statistics were cleared */
+	u64 rise;			/* last rising edge, 0 before the first */
+	int high;			/* a pulse started at rise and has not ended */
+	unsigned int edges;		/* since reset */
+	struct eint_interval period;
+	struct eint_interval width;
+};
+
+struct eint_reader {
+	struct eint_line *line;
+	unsigned int seen;
+};
+
+struct telemetry_reg {
+	u32 vaddr;
+	u32 offset;
+	u32 value;
+	u8 window;
+	u8 width;
+	u8 sampled;
+};
+
+/*
+ * Change-detecting sampler: every period_ms the watched registers are read
+ * and only the ones that differ from the previous sample are queued as
+ * struct lophilo_delta on the stream fifo.
+ */
+struct telemetry {
+	struct delayed_work work;
+	struct mutex lock;		/* regs, period_ms and fifo readers */
+	struct telemetry_reg regs[MAX_TELEMETRY_REGS];
+	int nr_regs;
+	unsigned int period_ms;
+	struct kfifo fifo;
+	wait_queue_head_t wait;
+	u32 dropped;
+	char line[TELEMETRY_LINE_SIZE];	/* partial watch line between writes */
+	int line_length;
+	struct dentry *dentry;
 };
 
+/*
+ * LED frame player. Frames are uploaded into the back buffer and only
+ * shown once committed, which swaps the buffers. The hrtimer steps fade+1
+ * times per frame, blending towards the next frame, and each step writes
+ * every LED's srgb word at once so a frame never tears. All control goes
+ * through lock, with the timer stopped while anything changes.
+ */
+struct ledfx {
+	struct hrtimer timer;
+	struct mutex lock;
+	struct lophilo_led_frame frames[2][MAX_LEDFX_FRAMES];
+	struct lophilo_led_frame *front;
+	struct lophilo_led_frame *back;
+	u32 nr_front;
+	u32 nr_back;
+	u32 frame;			/* position in front */
+	u32 step;			/* 0..fade within frame */
+	u32 fps;
+	u32 fade;
+	u32 loop;
+	u32 playing;
+	ktime_t period;
+	struct dentry *dentry;
+};
+
+/*
+ * Everything that belongs to one grid FPGA. Boards share no state besides
+ * fpga_wq, so each one is discovered, configured and serviced on its own.
+ */
+struct lophilo_board {
+	int index;
+	const struct board_desc *desc;
+
+	struct subsystem subsystems[MAX_SUBSYSTEMS];
+	int nr_subsystems;
+	struct subsystem sys_subsystem;
+	struct subsystem mod_subsystem;
+	struct subsystem fpga_data;
+	struct subsystem fpga_download;
+	struct eint_line eint[MAX_EINT];
+
+	struct fpga_loader loader;
+	struct telemetry telemetry;
+	struct ledfx ledfx;
+	struct platform_device *pdev;	/* for the firmware loader */
+	int discover_pending;		/* discovery waits for a configured FPGA */
+
+	char registry[MAX_REGISTRY_SIZE];
+	struct debugfs_blob_wrapper registry_blob;
+	struct channel_reg channel_regs[MAX_CHANNEL_REGS];
+	int nr_channel_regs;
+	char parent_name[MAX_PARENT_NAME]; // for generating names
+
+	struct dentry *lophilo_dentry;
+	struct dentry *fpga_dentry;
+};
+
+static struct lophilo_board *boards[MAX_BOARDS];
+
 static int device_open(struct inode *, struct file *);
 static int device_release(struct inode *, struct file *);
 static ssize_t device_read(struct file *, char *, size_t, loff_t *);
@@ -99,121 +409,358 @@ struct file_operations fops_mem = {
 	.mmap    = map_lophilo
  };
 
-static struct subsystem subsystems[MAX_SUBSYSTEMS];
+static int fpga_status_open(struct inode *, struct file *);
+static ssize_t fpga_status_read(struct file *, char *, size_t, loff_t *);
+static unsigned int fpga_status_poll(struct file *, poll_table *);
 
-static struct subsystem sys_subsystem = {
-	.id = SYS_SUBSYSTEM_ID,
-	.size = 0x204,
-	.paddr = SYS_PHYS_ADDR,
-	.offset = 0
+struct file_operations fops_fpga_status = {
+	.owner = THIS_MODULE,
+	.open = fpga_status_open,
+	.read = fpga_status_read,
+	.poll = fpga_status_poll,
+	.llseek = default_llseek
 };
 
-static struct subsystem mod_subsystem = {
-	.id = MOD_SUBSYSTEM_ID,
-	.paddr = MOD_PHYS_ADDR,
-	.offset = 0
+static int eint_open(struct inode *, struct file *);
+static int eint_release(struct inode *, struct file *);
+static ssize_t eint_read(struct file *, char *, size_t, loff_t *);
+static ssize_t eint_write(struct file *, const char *, size_t, loff_t *);
+static unsigned int eint_poll(struct file *, poll_table *);
+
+struct file_operations fops_eint = {
+	.owner = THIS_MODULE,
+	.open = eint_open,
+	.release = eint_release,
+	.read = eint_read,
+	.write = eint_write,
+	.poll = eint_poll,
+	.llseek = no_llseek
 };
 
-static struct subsystem fpga_data = {
-    .id = FPGA_DATA_ID,
+static int eint_stats_open(struct inode *, struct file *);
+static ssize_t eint_stats_read(struct file *, char *, size_t, loff_t *);
+static ssize_t eint_stats_write(struct file *, const char *, size_t, loff_t *);
+static int eint_mode_get(void *data, u64 *val);
+static int eint_mode_set(void *data, u64 val);
+
+struct file_operations fops_eint_stats = {
+	.owner = THIS_MODULE,
+	.open = eint_stats_open,
+	.read = eint_stats_read,
+	.write = eint_stats_write,
+	.llseek = default_llseek
 };
 
-static struct subsystem fpga_download = {
-    .id = FPGA_DOWNLOAD_ID,
+DEFINE_SIMPLE_ATTRIBUTE(fops_eint_mode, eint_mode_get, eint_mode_set, "%llu\n");
+
+static int telemetry_open(struct inode *, struct file *);
+static int telemetry_watch_release(struct inode *, struct file *);
+static ssize_t telemetry_watch_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t telemetry_stream_read(struct file *, char *, size_t, loff_t *);
+static unsigned int telemetry_stream_poll(struct file *, poll_table *);
+static int telemetry_period_get(void *data, u64 *val);
+static int telemetry_period_set(void *data, u64 val);
+
+struct file_operations fops_telemetry_watch = {
+	.owner = THIS_MODULE,
+	.open = telemetry_open,
+	.release = telemetry_watch_release,
+	.write = telemetry_watch_write,
+	.llseek = no_llseek
 };
 
-static struct subsystem irq0 = {
-    .id = IRQ_0_ID,
+struct file_operations fops_telemetry_stream = {
+	.owner = THIS_MODULE,
+	.open = telemetry_open,
+	.read = telemetry_stream_read,
+	.poll = telemetry_stream_poll,
+	.llseek = no_llseek
 };
 
-static struct subsystem irq1 = {
-    .id = IRQ_1_ID,
+DEFINE_SIMPLE_ATTRIBUTE(fops_telemetry_period, telemetry_period_get, telemetry_period_set, "%llu\n");
+
+static int ledfx_frames_open(struct inode *, struct file *);
+static ssize_t ledfx_frames_write(struct file *, const char *, size_t, loff_t *);
+static int ledfx_commit(void *data, u64 val);
+static int ledfx_playing_get(void *data, u64 *val);
+static int ledfx_playing_set(void *data, u64 val);
+static int ledfx_fps_get(void *data, u64 *val);
+static int ledfx_fps_set(void *data, u64 val);
+static int ledfx_fade_get(void *data, u64 *val);
+static int ledfx_fade_set(void *data, u64 val);
+static int ledfx_loop_get(void *data, u64 *val);
+static int ledfx_loop_set(void *data, u64 val);
+
+struct file_operations fops_ledfx_frames = {
+	.owner = THIS_MODULE,
+	.open = ledfx_frames_open,
+	.write = ledfx_frames_write,
+	.llseek = no_llseek
 };
 
-static struct subsystem irq2 = {
-    .id = IRQ_2_ID,
+DEFINE_SIMPLE_ATTRIBUTE(fops_ledfx_commit, NULL, ledfx_commit, "%llu\n");
+DEFINE_SIMPLE_ATTRIBUTE(fops_ledfx_playing, ledfx_playing_get, ledfx_playing_set, "%llu\n");
+DEFINE_SIMPLE_ATTRIBUTE(fops_ledfx_fps, ledfx_fps_get, ledfx_fps_set, "%llu\n");
+DEFINE_SIMPLE_ATTRIBUTE(fops_ledfx_fade, ledfx_fade_get, ledfx_fade_set, "%llu\n");
+DEFINE_SIMPLE_ATTRIBUTE(fops_ledfx_loop, ledfx_loop_get, ledfx_loop_set, "%llu\n");
+
+static int bitop_set(void *data, u64 val);
+static int bitop_clr(void *data, u64 val);
+static int bitop_tgl(void *data, u64 val);
+
+DEFINE_SIMPLE_ATTRIBUTE(fops_bit_set, NULL, bitop_set, "0x%08llx\n");
+DEFINE_SIMPLE_ATTRIBUTE(fops_bit_clr, NULL, bitop_clr, "0x%08llx\n");
+DEFINE_SIMPLE_ATTRIBUTE(fops_bit_tgl, NULL, bitop_tgl, "0x%08llx\n");
+
+static int channel_get(void *data, u64 *val);
+static int channel_set(void *data, u64 val);
+
+// same formats as debugfs_create_x8/x16/x32
+DEFINE_SIMPLE_ATTRIBUTE(fops_channel8, channel_get, channel_set, "0x%02llx\n");
+DEFINE_SIMPLE_ATTRIBUTE(fops_channel16, channel_get, channel_set, "0x%04llx\n");
+DEFINE_SIMPLE_ATTRIBUTE(fops_channel32, channel_get, channel_set, "0x%08llx\n");
+
+static ssize_t trace_read(struct file *, char *, size_t, loff_t *);
+static int trace_enabled_get(void *data, u64 *val);
+static int trace_enabled_set(void *data, u64 val);
+static int trace_dropped_get(void *data, u64 *val);
+
+struct file_operations fops_trace = {
+	.owner = THIS_MODULE,
+	.open = nonseekable_open,
+	.read = trace_read,
+	.llseek = no_llseek
 };
 
-static struct subsystem irq3 = {
-    .id = IRQ_3_ID,
-};
+DEFINE_SIMPLE_ATTRIBUTE(fops_trace_enabled, trace_enabled_get, trace_enabled_set, "%llu\n");
+DEFINE_SIMPLE_ATTRIBUTE(fops_trace_dropped, trace_dropped_get, NULL, "%llu\n");
 
-static struct subsystem irq4 = {
-    .id = IRQ_4_ID,
-};
+struct resource * fpga;
 
-static struct subsystem irq5 = {
-    .id = IRQ_5_ID,
-};
+#define CREATE_CHANNEL_FILE(size, name, offset) \
+	create_channel_file(board, subsystem, root, size, name, addr + offset); \
+	create_registry_entry(board, size, name, addr, offset);
 
-static struct subsystem irq6 = {
-    .id = IRQ_6_ID,
-};
+#define CREATE_BITOP_FILES(name, offset) \
+	create_bitop_files(subsystem, root, name, addr + offset);
 
-static struct subsystem irq7 = {
-    .id = IRQ_7_ID,
-};
+static u32 lophilo_ioread(u32 vaddr, u8 width)
+{
+	switch(width) {
+		case 8:
+			return ioread8((void*) vaddr);
+		case 16:
+			return ioread16((void*) vaddr);
+		default:
+			return ioread32((void*) vaddr);
+	}
+}
 
-char registry[MAX_REGISTRY_SIZE];
-static struct debugfs_blob_wrapper registry_blob = {
-	.data = registry,
-	.size = 0
-};
+static void lophilo_iowrite(u32 vaddr, u8 width, u32 value)
+{
+	switch(width) {
+		case 8:
+			iowrite8(value, (void*) vaddr);
+			break;
+		case 16:
+			iowrite16(value, (void*) vaddr);
+			break;
+		default:
+			iowrite32(value, (void*) vaddr);
+			break;
+	}
+}
 
-struct resource * fpga;
+static void lophilo_trace(struct subsystem *subsystem, u32 vaddr, u8 width, u8 op, u32 value)
+{
+	struct lophilo_board *board = subsystem->board;
+	struct trace_ring *ring = this_cpu_ptr(trace_rings);
+	struct lophilo_trace_record *record;
+
+	if(ring->head - ACCESS_ONCE(ring->tail) == trace_size) {
+		ring->dropped++;
+		return;
+	}
+	record = &ring->records[ring->head & (trace_size - 1)];
+	record->timestamp = ktime_to_ns(ktime_get());
+	if(subsystem == &board->sys_subsystem) {
+		record->window = LOPHILO_WINDOW_SYS;
+		record->offset = vaddr - board->sys_subsystem.vaddr;
+	} else {
+		record->window = LOPHILO_WINDOW_MOD;
+		record->offset = vaddr - board->mod_subsystem.vaddr;
+	}
+	record->value = value;
+	record->pid = in_interrupt() ? 0 : current->pid;
+	record->board = board->index;
+	record->width = width;
+	record->op = op;
+	smp_wmb();
+	ring->head++;
+}
+
+/*
+ * Apply one LOPHILO_OP_* to the register at vaddr. The read-modify-write
+ * happens under the owning subsystem's lock so concurrent set/clear/toggle
+ * callers never lose each other's bits. Every register write of the driver
+ * goes through here, which is where it is traced.
+ */
+static void lophilo_modify(struct subsystem *subsystem, u32 vaddr, u8 width, u8 op, u32 value)
+{
+	unsigned long flags;
+	u32 reg;
+
+	spin_lock_irqsave(&subsystem->lock, flags);
+	switch(op) {
+		case LOPHILO_OP_SET:
+			reg = lophilo_ioread(vaddr, width) | value;
+			break;
+		case LOPHILO_OP_CLR:
+			reg = lophilo_ioread(vaddr, width) & ~value;
+			break;
+		case LOPHILO_OP_TGL:
+			reg = lophilo_ioread(vaddr, width) ^ value;
+			break;
+		default:
+			reg = value;
+			break;
+	}
+	lophilo_iowrite(vaddr, width, reg);
+	if(trace_enabled)
+		lophilo_trace(subsystem, vaddr, width, op, reg);
+	spin_unlock_irqrestore(&subsystem->lock, flags);
+}
 
-static struct dentry *lophilo_dentry;
-static struct dentry *fpga_dentry;
+static int bitop_set(void *data, u64 val)
+{
+	struct bitop_reg *reg = data;
 
-char parent_name[MAX_PARENT_NAME]; // for generating names
+	lophilo_modify(reg->subsystem, reg->vaddr, 32, LOPHILO_OP_SET, val);
+	return 0;
+}
 
-#define CREATE_CHANNEL_FILE(size, name, offset) \
-	debugfs_create_x##size( \
-		name, \
-		S_IRWXU | S_IRWXG | S_IRWXO, \
-		root, \
-		(void*) addr + offset); \
-	create_registry_entry(size, parent_name, name, addr, offset);
+static int bitop_clr(void *data, u64 val)
+{
+	struct bitop_reg *reg = data;
+
+	lophilo_modify(reg->subsystem, reg->vaddr, 32, LOPHILO_OP_CLR, val);
+	return 0;
+}
+
+static int bitop_tgl(void *data, u64 val)
+{
+	struct bitop_reg *reg = data;
+
+	lophilo_modify(reg->subsystem, reg->vaddr, 32, LOPHILO_OP_TGL, val);
+	return 0;
+}
+
+static int channel_get(void *data, u64 *val)
+{
+	struct channel_reg *reg = data;
+
+	*val = lophilo_ioread(reg->vaddr, reg->width);
+	return 0;
+}
+
+static int channel_set(void *data, u64 val)
+{
+	struct channel_reg *reg = data;
+
+	lophilo_modify(reg->subsystem, reg->vaddr, reg->width, LOPHILO_OP_WRITE, val);
+	return 0;
+}
+
+void create_channel_file(struct lophilo_board *board, struct subsystem *subsystem,
+	struct dentry *root, u8 size, char *name, u32 vaddr)
+{
+	struct channel_reg *reg;
+	const struct file_operations *fops;
+
+	if(board->nr_channel_regs == MAX_CHANNEL_REGS) {
+		printk(KERN_ERR "Unable to add %s/%s; out of register files", board->parent_name, name);
+		return;
+	}
+	reg = &board->channel_regs[board->nr_channel_regs++];
+	reg->subsystem = subsystem;
+	reg->vaddr = vaddr;
+	reg->width = size;
+
+	switch(size) {
+		case 8:
+			fops = &fops_channel8;
+			break;
+		case 16:
+			fops = &fops_channel16;
+			break;
+		default:
+			fops = &fops_channel32;
+			break;
+	}
+	debugfs_create_file(name, S_IRWXU | S_IRWXG | S_IRWXO, root, reg, fops);
+}
+
+void create_bitop_files(struct subsystem *subsystem, struct dentry *root, char *name, u32 addr)
+{
+	struct bitop_reg *reg;
+	char file_name[MAX_PARENT_NAME];
+
+	if(subsystem->nr_bitops == MAX_BITOPS) {
+		printk(KERN_ERR "Unable to add %s bit operations; out of space", name);
+		return;
+	}
+	reg = &subsystem->bitops[subsystem->nr_bitops++];
+	reg->subsystem = subsystem;
+	reg->vaddr = addr;
+
+	scnprintf(file_name, MAX_PARENT_NAME, "%s_set", name);
+	debugfs_create_file(file_name, S_IWUSR | S_IWGRP | S_IWOTH, root, reg, &fops_bit_set);
+	scnprintf(file_name, MAX_PARENT_NAME, "%s_clr", name);
+	debugfs_create_file(file_name, S_IWUSR | S_IWGRP | S_IWOTH, root, reg, &fops_bit_clr);
+	scnprintf(file_name, MAX_PARENT_NAME, "%s_tgl", name);
+	debugfs_create_file(file_name, S_IWUSR | S_IWGRP | S_IWOTH, root, reg, &fops_bit_tgl);
+}
 
-void create_registry_entry(u8 size, char* parent_name, char* name, u32 addr, u32 offset)
+void create_registry_entry(struct lophilo_board *board, u8 size, char* name, u32 addr, u32 offset)
 {
 	char* type_sys = "sys";
 	char* type_mod = "mod";
 	char* type;
 	int length;
 
-	if(addr < (u32)fpga_cs1_base) {
+	if(addr < board->mod_subsystem.vaddr) {
 		type = type_sys;
-		offset += addr - (u32)fpga_cs0_base;
+		offset += addr - board->sys_subsystem.vaddr;
 	}  else {
 		type = type_mod;
-		offset += addr - (u32)fpga_cs1_base;
+		offset += addr - board->mod_subsystem.vaddr;
 	}
 	// size is number of characters written, excluding trailing '\0'
-	if(registry_blob.size+1 >= MAX_REGISTRY_SIZE) {
-		printk(KERN_ERR "Unable to add %s/%s to registry; out of space", parent_name, name);
+	if(board->registry_blob.size+1 >= MAX_REGISTRY_SIZE) {
+		printk(KERN_ERR "Unable to add %s/%s to registry; out of space", board->parent_name, name);
 		return;
 	}
 	// http://www.kernel.org/doc/htmldocs/kernel-api/API-scnprintf.html
 	// The return value is the number of characters written into buf not including the trailing '\0'.
 	// If size is == 0 the function returns 0.
-	length = scnprintf(&registry[registry_blob.size],
-		MAX_REGISTRY_SIZE - registry_blob.size,
+	length = scnprintf(&board->registry[board->registry_blob.size],
+		MAX_REGISTRY_SIZE - board->registry_blob.size,
 		"%s %u %s %s %u\n",
-		type, size, parent_name, name, offset);
-	registry_blob.size += length;
-	//printk(KERN_INFO "registry updated size: %d", registry_blob.size);
+		type, size, board->parent_name, name, offset);
+	board->registry_blob.size += length;
+	//printk(KERN_INFO "registry updated size: %d", board->registry_blob.size);
 }
 
 
- struct dentry * create_channel_gpio(u8 id, struct dentry * parent, u32 addr)
+ struct dentry * create_channel_gpio(struct lophilo_board *board, u8 id, struct dentry * parent, struct subsystem *subsystem)
  {
+ 	u32 addr = subsystem->vaddr;
  	int i;
  	struct dentry * root;
  	char io_name[MAX_IO_NAME];
 
- 	scnprintf(parent_name, MAX_PARENT_NAME, "gpio%d", id);
- 	root  = debugfs_create_dir(parent_name, parent);
+ 	scnprintf(board->parent_name, MAX_PARENT_NAME, "gpio%d", id);
+ 	root  = debugfs_create_dir(board->parent_name, parent);
 
  	CREATE_CHANNEL_FILE(32, "dout", 0x8);
  	CREATE_CHANNEL_FILE(32, "din", 0xc);
@@ -223,6 +770,8 @@ void create_registry_entry(u8 size, char* parent_name, char* name, u32 addr, u32
  	CREATE_CHANNEL_FILE(32, "ie", 0x28);
  	CREATE_CHANNEL_FILE(32, "iinv", 0x2c);
  	CREATE_CHANNEL_FILE(32, "iedge", 0x30);
+ 	CREATE_BITOP_FILES("dout", 0x8);
+ 	CREATE_BITOP_FILES("doe", 0x10);
  	for(i=0; i<26; i++) {
  		scnprintf(io_name, MAX_IO_NAME, "io%d", i);
  		CREATE_CHANNEL_FILE(8, io_name, 0x40 + i);
@@ -230,12 +779,13 @@ void create_registry_entry(u8 size, char* parent_name, char* name, u32 addr, u32
  	return root;
  }
 
- struct dentry * create_led(u8 id,  struct dentry * parent, u32 addr)
+ struct dentry * create_led(struct lophilo_board *board, u8 id,  struct dentry * parent, u32 addr)
  {
+ 	struct subsystem *subsystem = &board->sys_subsystem;
  	struct dentry * root;
 
-	scnprintf(parent_name, MAX_PARENT_NAME, "led%d", id);
-	root = debugfs_create_dir(parent_name, parent);
+	scnprintf(board->parent_name, MAX_PARENT_NAME, "led%d", id);
+	root = debugfs_create_dir(board->parent_name, parent);
 
  	CREATE_CHANNEL_FILE(8, "b",  0x100 + 0x4 * id);
  	CREATE_CHANNEL_FILE(8, "g",  0x101 + 0x4 * id);
@@ -246,12 +796,13 @@ void create_registry_entry(u8 size, char* parent_name, char* name, u32 addr, u32
  	return root;
  }
 
- struct dentry * create_channel_pwm(u8 id, struct dentry * parent, u32 addr)
+ struct dentry * create_channel_pwm(struct lophilo_board *board, u8 id, struct dentry * parent, struct subsystem *subsystem)
  {
+ 	u32 addr = subsystem->vaddr;
  	struct dentry * root;
 
- 	scnprintf(parent_name, MAX_PARENT_NAME, "pwm%d", id);
- 	root = debugfs_create_dir(parent_name, parent);
+ 	scnprintf(board->parent_name, MAX_PARENT_NAME, "pwm%d", id);
+ 	root = debugfs_create_dir(board->parent_name, parent);
 
  	CREATE_CHANNEL_FILE(8, "reset", 0x8);
  	CREATE_CHANNEL_FILE(8, "outinv", 0x9);
@@ -263,58 +814,61 @@ void create_registry_entry(u8 size, char* parent_name, char* name, u32 addr, u32
 	return root;
  }
 
- void create_root(struct dentry * root, u32 addr)
+ void create_root(struct lophilo_board *board, struct dentry * root, u32 addr)
  {
- 	strcpy(parent_name, "lophilo"); // strlen(lophilo) << MAX_PARENT_NAME
+ 	struct subsystem *subsystem = &board->sys_subsystem;
+
+ 	strcpy(board->parent_name, "lophilo"); // strlen(lophilo) << MAX_PARENT_NAME
  	CREATE_CHANNEL_FILE(16, "id", 0x0);
 	CREATE_CHANNEL_FILE(16, "flag", 0x2);
 	CREATE_CHANNEL_FILE(32, "ver", 0x4);
 	CREATE_CHANNEL_FILE(32, "lock", 0x8);
 	CREATE_CHANNEL_FILE(32, "lockb", 0xc);
 	CREATE_CHANNEL_FILE(32, "power", 0x200);
+	CREATE_BITOP_FILES("power", 0x200);
 }
 
 
-static void GRID_RESET(void)
+static void GRID_RESET(const struct fpga_pins *pins)
 {
-    at91_set_gpio_value(AT91_PIN_PA27, 0);
+    at91_set_gpio_value(pins->grid_reset, 0);
 }
-static GRID_UNRESET(void)
+static void GRID_UNRESET(const struct fpga_pins *pins)
 {
-    at91_set_gpio_value(AT91_PIN_PA27, 1);
+    at91_set_gpio_value(pins->grid_reset, 1);
 }
 
-static void FPGA_CONF_N(void)
+static void FPGA_CONF_N(const struct fpga_pins *pins)
 {
-    at91_set_gpio_value(AT91_PIN_PB16, 0);
+    at91_set_gpio_value(pins->conf, 0);
 }
-static void FPGA_CONF_P(void)
+static void FPGA_CONF_P(const struct fpga_pins *pins)
 {
-    at91_set_gpio_value(AT91_PIN_PB16, 1);
+    at91_set_gpio_value(pins->conf, 1);
 }
-static void FPGA_DCLK_N(void)
+static void FPGA_DCLK_N(const struct fpga_pins *pins)
 {
-    at91_set_gpio_value(AT91_PIN_PB17, 0);
+    at91_set_gpio_value(pins->dclk, 0);
 }
-static void FPGA_DCLK_P(void)
+static void FPGA_DCLK_P(const struct fpga_pins *pins)
 {
-    at91_set_gpio_value(AT91_PIN_PB17, 1);
+    at91_set_gpio_value(pins->dclk, 1);
 }
-static void FPGA_DATA_N(void)
+static void FPGA_DATA_N(const struct fpga_pins *pins)
 {
-    at91_set_gpio_value(AT91_PIN_PB15, 0);
+    at91_set_gpio_value(pins->data, 0);
 }
-static void FPGA_DATA_P(void)
+static void FPGA_DATA_P(const struct fpga_pins *pins)
 {
-    at91_set_gpio_value(AT91_PIN_PB15, 1);
+    at91_set_gpio_value(pins->data, 1);
 }
-static int FPGA_DONE(void)
+static int FPGA_DONE(const struct fpga_pins *pins)
 {
-    return at91_get_gpio_value(AT91_PIN_PB14);
+    return at91_get_gpio_value(pins->done);
 }
-static int FPGA_STAT(void)
+static int FPGA_STAT(const struct fpga_pins *pins)
 {
-    return at91_get_gpio_value(AT91_PIN_PB18);
+    return at91_get_gpio_value(pins->stat);
 }
 static void SYS_RESET(void)
 {
@@ -333,48 +887,70 @@ static void BTNDIS_P(void)
     at91_set_gpio_value(AT91_PIN_PB2, 1);
 }
 
-void FPGA_Config(unsigned char* gridFilebuffer, int gridFileSize)
+static int fpga_expired(struct fpga_loader *loader)
+{
+	return time_after(jiffies,
+		loader->start + msecs_to_jiffies(fpga_timeout_ms));
+}
+
+/*
+ * Shift a bitstream into the FPGA. Runs from fpga_wq; returns 0 once DONE
+ * rises, -ETIMEDOUT if fpga_timeout_ms elapses, -ECANCELED if a cancel was
+ * requested through fpga/download and -EIO if the whole image was shifted
+ * without DONE.
+ */
+int FPGA_Config(struct fpga_loader *loader, unsigned char* gridFilebuffer, int gridFileSize)
 {
+    const struct fpga_pins *pins = loader->pins;
     int i;
     unsigned char buf, cnt;
 
-    at91_set_GPIO_periph(AT91_PIN_PA27,0);
-    if(at91_set_gpio_output(AT91_PIN_PA27, 0)) {
-        printk(KERN_DEBUG"Could not set pin %i for GPIO input.\n", AT91_PIN_PD10);
+    at91_set_GPIO_periph(pins->grid_reset,0);
+    if(at91_set_gpio_output(pins->grid_reset, 0)) {
+        printk(KERN_DEBUG"Could not set pin %i for GPIO input.\n", pins->grid_reset);
     }
-    GRID_RESET();
+    GRID_RESET(pins);
 
-    at91_set_GPIO_periph(AT91_PIN_PB18,0);
-    at91_set_GPIO_periph(AT91_PIN_PB17,0);
-    at91_set_GPIO_periph(AT91_PIN_PB16,0);
-    at91_set_GPIO_periph(AT91_PIN_PB15,0);
-    at91_set_GPIO_periph(AT91_PIN_PB14,0);
+    at91_set_GPIO_periph(pins->stat,0);
+    at91_set_GPIO_periph(pins->dclk,0);
+    at91_set_GPIO_periph(pins->conf,0);
+    at91_set_GPIO_periph(pins->data,0);
+    at91_set_GPIO_periph(pins->done,0);
 
-    if(at91_set_gpio_output(AT91_PIN_PB17, 0)) {
-        printk(KERN_DEBUG"Could not set pin %i for GPIO input.\n", AT91_PIN_PB17);
+    if(at91_set_gpio_output(pins->dclk, 0)) {
+        printk(KERN_DEBUG"Could not set pin %i for GPIO input.\n", pins->dclk);
     }
-    if(at91_set_gpio_output(AT91_PIN_PB16, 0)) {
-        printk(KERN_DEBUG"Could not set pin %i for GPIO input.\n", AT91_PIN_PB16);
+    if(at91_set_gpio_output(pins->conf, 0)) {
+        printk(KERN_DEBUG"Could not set pin %i for GPIO input.\n", pins->conf);
     }
-    if(at91_set_gpio_output(AT91_PIN_PB15, 0)) {
-        printk(KERN_DEBUG"Could not set pin %i for GPIO input.\n", AT91_PIN_PB15);
+    if(at91_set_gpio_output(pins->data, 0)) {
+        printk(KERN_DEBUG"Could not set pin %i for GPIO input.\n", pins->data);
     }
-	if(at91_set_gpio_input(AT91_PIN_PB18, 0)) {
-		printk(KERN_DEBUG"Could not set pin %i for GPIO input.\n", AT91_PIN_PB18);
+	if(at91_set_gpio_input(pins->stat, 0)) {
+		printk(KERN_DEBUG"Could not set pin %i for GPIO input.\n", pins->stat);
 	}
-	if(at91_set_gpio_input(AT91_PIN_PB14, 0)) {
-		printk(KERN_DEBUG"Could not set pin %i for GPIO input.\n", AT91_PIN_PB14);
+	if(at91_set_gpio_input(pins->done, 0)) {
+		printk(KERN_DEBUG"Could not set pin %i for GPIO input.\n", pins->done);
 	}
 
-    FPGA_CONF_N();
+    FPGA_CONF_N(pins);
 
-    FPGA_CONF_P();
+    FPGA_CONF_P(pins);
 
-    while(!FPGA_STAT());
+    while(!FPGA_STAT(pins)) {
+        if(loader->cancel)
+            return -ECANCELED;
+        if(fpga_expired(loader)) {
+            printk(KERN_ERR "FPGA STATUS did not rise within %u ms\n", fpga_timeout_ms);
+            return -ETIMEDOUT;
+        }
+        // sleep rather than spin: STATUS can take a while and we have one CPU
+        usleep_range(100, 200);
+    }
 
     printk("Start config FPGA [");
 
-    for(i = 0; i <= gridFileSize; i++)
+    for(i = 0; i < gridFileSize; i++)
     {
         buf = *(gridFilebuffer + i);
 
@@ -382,260 +958,1193 @@ void FPGA_Config(unsigned char* gridFilebuffer, int gridFileSize)
         {
             if(((buf>>(cnt))&(0x1))==0x1)
             {
-                FPGA_DATA_P();
+                FPGA_DATA_P(pins);
             }
             else
             {
-                FPGA_DATA_N();
+                FPGA_DATA_N(pins);
             }
-            FPGA_DCLK_P();
-            FPGA_DCLK_N();
+            FPGA_DCLK_P(pins);
+            FPGA_DCLK_N(pins);
         }
+        loader->bytes = i + 1;
 
-        if(FPGA_DONE())
+        if(FPGA_DONE(pins))
         {
             printk("]\n\r");
             break;
         }
 
+        if(i % 4096 == 0) {
+            if(loader->cancel) {
+                printk("] cancelled\n");
+                return -ECANCELED;
+            }
+            if(fpga_expired(loader)) {
+                printk("] timed out\n");
+                return -ETIMEDOUT;
+            }
+            cond_resched();
+        }
+
         if(i % 12000 == 0) printk(".");
     }
 
-    if(!FPGA_DONE()) printk("FPGA configuration failed.\n");
-    else {
-        GRID_UNRESET();
+    if(!FPGA_DONE(pins)) {
+        printk("FPGA configuration failed.\n");
+        return -EIO;
     }
+    GRID_UNRESET(pins);
+    return 0;
 }
 
-DECLARE_WAIT_QUEUE_HEAD (EINT0);
-volatile unsigned char irq_flag = 0;
-static irqreturn_t irq_interrupt_irq0(int irq, void *dev_id, struct pt_regs *regs)
-{
-   printk("<1>interrupt 0\n");
-   irq_flag = 1;
-   wake_up_interruptible(&EINT0);
-   return IRQ_HANDLED;
-}
+static int lophilo_discover(struct lophilo_board *board);
 
-static int __init
-lophilo_init(void)
+static void fpga_download_work(struct work_struct *work)
 {
-	struct dentry *lophilo_subsystem_dentry;
-	int subsystem_id = 0;
+	struct fpga_loader *loader = container_of(work, struct fpga_loader, work);
+	struct lophilo_board *board = container_of(loader, struct lophilo_board, loader);
+	unsigned char *data;
 	int result;
 
-	void* current_addr;
-	int i, ret;
-	u8 pwm_id = 0;
-	u8 gpio_id = 0;
-
-	printk(KERN_INFO "Lophilo module loading\n");
-
-	lophilo_dentry = debugfs_create_dir(
-		"lophilo",
-		NULL);
-	if(lophilo_dentry == NULL) {
-		printk(KERN_ERR "Could not create root directory entry lophilo in debugfs");
-		return -EINVAL;
+	if(loader->firmware)
+		data = (unsigned char*) loader->firmware->data;
+	else
+		data = loader->buffer;
+	result = FPGA_Config(loader, data, loader->length);
+
+	// the register map is only meaningful once DONE is up; finish the
+	// discovery before status reports done
+	if(result == 0 && board->discover_pending) {
+		board->discover_pending = 0;
+		lophilo_discover(board);
 	}
 
-    fpga_dentry = debugfs_create_dir(
-        "fpga",
-        NULL);
-    if(fpga_dentry == NULL) {
-        printk(KERN_ERR "Could not create root directory entry FPGA in debugfs");
-        return -EINVAL;
-    }
-
-    /** Set pin as GPIO periph, without internal pull up */
-    at91_set_GPIO_periph(AT91_PIN_PD10,0);   //M1-EINT0
-    at91_set_GPIO_periph(AT91_PIN_PD11,0);   //M1-EINT1
-    at91_set_GPIO_periph(AT91_PIN_PD13,0);   //M1-EINT2
-    at91_set_GPIO_periph(AT91_PIN_PD14,0);   //M1-EINT3
-    at91_set_GPIO_periph(AT91_PIN_PD17,0);   //M1-EINT4
-    at91_set_GPIO_periph(AT91_PIN_PD18,0);   //M1-EINT5
-    at91_set_GPIO_periph(AT91_PIN_PD19,0);   //M1-EINT6
-    at91_set_GPIO_periph(AT91_PIN_PB0,0);    //M1-EINT7
-
-    /** Set pin as GPIO input, without internal pull up */
-    if(at91_set_gpio_input(AT91_PIN_PD10, 0)) {
-        printk(KERN_ERR"Could not set pin %i for GPIO input.\n", AT91_PIN_PD10);
-    }
-    if(at91_set_gpio_input(AT91_PIN_PD11, 0)) {
-        printk(KERN_ERR"Could not set pin %i for GPIO input.\n", AT91_PIN_PD11);
-    }
-    if(at91_set_gpio_input(AT91_PIN_PD13, 0)) {
-        printk(KERN_ERR"Could not set pin %i for GPIO input.\n", AT91_PIN_PD13);
-    }
-    if(at91_set_gpio_input(AT91_PIN_PD14, 0)) {
-        printk(KERN_ERR"Could not set pin %i for GPIO input.\n", AT91_PIN_PD14);
-    }
-    if(at91_set_gpio_input(AT91_PIN_PD17, 0)) {
-        printk(KERN_ERR"Could not set pin %i for GPIO input.\n", AT91_PIN_PD17);
-    }
-    if(at91_set_gpio_input(AT91_PIN_PD18, 0)) {
-        printk(KERN_ERR"Could not set pin %i for GPIO input.\n", AT91_PIN_PD18);
-    }
-    if(at91_set_gpio_input(AT91_PIN_PD19, 0)) {
-        printk(KERN_ERR"Could not set pin %i for GPIO input.\n", AT91_PIN_PD19);
-    }
-    if(at91_set_gpio_input(AT91_PIN_PB0, 0)) {
-        printk(KERN_ERR"Could not set pin %i for GPIO input.\n", AT91_PIN_PB0);
-    }
-
-    /** Set deglitch for pin */
-    if(at91_set_deglitch(AT91_PIN_PD10, 1)) {
-        printk(KERN_ERR"Could not set pin %i for GPIO deglitch.\n", AT91_PIN_PD10);
-    }
-    if(at91_set_deglitch(AT91_PIN_PD11, 1)) {
-        printk(KERN_ERR"Could not set pin %i for GPIO deglitch.\n", AT91_PIN_PD11);
-    }
-    if(at91_set_deglitch(AT91_PIN_PD13, 1)) {
-        printk(KERN_ERR"Could not set pin %i for GPIO deglitch.\n", AT91_PIN_PD13);
-    }
-    if(at91_set_deglitch(AT91_PIN_PD14, 1)) {
-        printk(KERN_ERR"Could not set pin %i for GPIO deglitch.\n", AT91_PIN_PD14);
-    }
-    if(at91_set_deglitch(AT91_PIN_PD18, 1)) {
-        printk(KERN_ERR"Could not set pin %i for GPIO deglitch.\n", AT91_PIN_PD18);
-    }
-    if(at91_set_deglitch(AT91_PIN_PD19, 1)) {
-        printk(KERN_ERR"Could not set pin %i for GPIO deglitch.\n", AT91_PIN_PD19);
-    }
-    if(at91_set_deglitch(AT91_PIN_PB0, 1)) {
-        printk(KERN_ERR"Could not set pin %i for GPIO deglitch.\n", AT91_PIN_PB0);
-    }
+	mutex_lock(&loader->lock);
+	kfree(loader->buffer);
+	loader->buffer = NULL;
+	release_firmware(loader->firmware);
+	loader->firmware = NULL;
+	loader->length = 0;
+	loader->result = result;
+	loader->end = jiffies;
+	switch(result) {
+		case 0:
+			loader->state = FPGA_STATE_DONE;
+			break;
+		case -ETIMEDOUT:
+			loader->state = FPGA_STATE_TIMEOUT;
+			break;
+		case -ECANCELED:
+			loader->state = FPGA_STATE_CANCELLED;
+			break;
+		default:
+			loader->state = FPGA_STATE_FAILED;
+			break;
+	}
+	mutex_unlock(&loader->lock);
 
-    /** Request IRQ for pin */
-    if(ret = request_irq(AT91_PIN_PD10, irq_interrupt_irq0, IRQ_TYPE_EDGE_BOTH, "irq_interrupt", NULL))  {
-        printk(KERN_ERR"Can't register IRQ %d, mode %d\n", AT91_PIN_PD10, IRQ_TYPE_EDGE_BOTH);
-        printk(KERN_ERR"ret = %d\n", ret);
-        //return -EIO;
-    }
+	wake_up_interruptible(&loader->wait);
+}
 
-    printk(KERN_ERR "lizhizhou 2");
+/* Queue the buffered bitstream; the caller holds loader->lock */
+static int fpga_download_start(struct fpga_loader *loader)
+{
+	if(loader->pins->conf == PIN_NONE)
+		return -ENODEV;
+	if(loader->state == FPGA_STATE_RUNNING)
+		return -EBUSY;
+	if(!loader->length) {
+		printk("No data to download\n");
+		return -ENODATA;
+	}
+	loader->state = FPGA_STATE_RUNNING;
+	loader->result = 0;
+	loader->bytes = 0;
+	loader->cancel = 0;
+	loader->start = jiffies;
+	queue_work(fpga_wq, &loader->work);
+	return 0;
+}
 
-    debugfs_create_file(
-        "data",
-        S_IRWXU | S_IRWXG | S_IRWXO,
-        fpga_dentry,
-        &fpga_data,
-        &fops_mem
-        );
-    debugfs_create_file(
-        "download",
-        S_IRWXU | S_IRWXG | S_IRWXO,
-        fpga_dentry,
-        &fpga_download,
-        &fops_mem
-        );
-	debugfs_create_file(
-		"EINT0",
-		S_IRWXU | S_IRWXG | S_IRWXO,
-		lophilo_dentry,
-		&irq0,
-		&fops_mem
-		);
-	debugfs_create_file(
-		"EINT1",
-		S_IRWXU | S_IRWXG | S_IRWXO,
-		lophilo_dentry,
-		&irq1,
-		&fops_mem
-		);
-	debugfs_create_file(
-		"EINT2",
-		S_IRWXU | S_IRWXG | S_IRWXO,
-		lophilo_dentry,
-		&irq2,
-		&fops_mem
-		);
-	debugfs_create_file(
-		"EINT3",
-		S_IRWXU | S_IRWXG | S_IRWXO,
-		lophilo_dentry,
-		&irq3,
-		&fops_mem
-		);
-	debugfs_create_file(
-		"EINT4",
-		S_IRWXU | S_IRWXG | S_IRWXO,
-		lophilo_dentry,
-		&irq4,
-		&fops_mem
-		);
-	debugfs_create_file(
-		"EINT5",
-		S_IRWXU | S_IRWXG | S_IRWXO,
-		lophilo_dentry,
-		&irq5,
-		&fops_mem
-		);
-	debugfs_create_file(
-		"EINT6",
-		S_IRWXU | S_IRWXG | S_IRWXO,
-		lophilo_dentry,
-		&irq6,
-		&fops_mem
-		);
-	debugfs_create_file(
-		"EINT7",
-		S_IRWXU | S_IRWXG | S_IRWXO,
-		lophilo_dentry,
-		&irq7,
-		&fops_mem
-		);
+/* request_firmware_nowait completion: shift the image on fpga_wq */
+static void lophilo_firmware_loaded(const struct firmware *fw, void *context)
+{
+	struct lophilo_board *board = context;
+	struct fpga_loader *loader = &board->loader;
+	int ret;
 
-	//fpga = request_mem_region(FPGA_BASE_ADDR, SIZE16MB, "Lophilo FPGA LEDs");
-	sys_subsystem.vaddr = (u32) fpga_cs0_base;
-	mod_subsystem.vaddr = (u32) fpga_cs1_base;
+	if(fw == NULL) {
+		printk(KERN_ERR "Lophilo %d could not load firmware %s; discovery waits for fpga/download\n",
+			board->index, firmware[board->index]);
+		return;
+	}
 
-	create_root(lophilo_dentry, sys_subsystem.vaddr);
+	mutex_lock(&loader->lock);
+	if(loader->state == FPGA_STATE_RUNNING || loader->length) {
+		ret = -EBUSY;
+	} else {
+		loader->firmware = fw;
+		loader->length = fw->size;
+		ret = fpga_download_start(loader);
+		if(ret) {
+			loader->firmware = NULL;
+			loader->length = 0;
+		}
+	}
+	mutex_unlock(&loader->lock);
 
-	debugfs_create_file(
-		"sysmem",
-		S_IRWXU | S_IRWXG | S_IRWXO,
-		lophilo_dentry,
-		&sys_subsystem,
-		&fops_mem
-		);
+	if(ret) {
+		printk(KERN_ERR "Lophilo %d could not start download of %s: %d\n",
+			board->index, firmware[board->index], ret);
+		release_firmware(fw);
+	}
+}
 
-	debugfs_create_file(
-		"modmem",
-		S_IRWXU | S_IRWXG | S_IRWXO,
-		lophilo_dentry,
-		&mod_subsystem,
-		&fops_mem
-		);
+/* Boards without configuration pins can't take a bitstream */
+static int lophilo_preloads(struct lophilo_board *board)
+{
+	return firmware[board->index] && board->desc->fpga.conf != PIN_NONE;
+}
 
+static int lophilo_firmware_request(struct lophilo_board *board)
+{
+	int ret;
 
-	for(i=0; i<4; i++) {
-		create_led(i, lophilo_dentry, sys_subsystem.vaddr);
+	board->pdev = platform_device_register_simple("lophilo", board->index, NULL, 0);
+	if(IS_ERR(board->pdev)) {
+		ret = PTR_ERR(board->pdev);
+		board->pdev = NULL;
+		return ret;
 	}
 
-	current_addr = fpga_cs1_base;
+	board->discover_pending = 1;
+	ret = request_firmware_nowait(THIS_MODULE, FW_ACTION_HOTPLUG,
+		firmware[board->index], &board->pdev->dev, GFP_KERNEL,
+		board, lophilo_firmware_loaded);
+	if(ret)
+		board->discover_pending = 0;
+	return ret;
+}
 
-	while(true) {
-		if(subsystem_id == MAX_SUBSYSTEMS) {
+static int fpga_status_open(struct inode *inode, struct file *file)
+{
+	file->private_data = inode->i_private;
+	return 0;
+}
+
+static ssize_t fpga_status_read(struct file *filp,
+	char *buffer,
+	size_t length,
+	loff_t *offset)
+{
+	struct fpga_loader *loader = filp->private_data;
+	char status[FPGA_STATUS_SIZE];
+	unsigned long end;
+	int size;
+
+	mutex_lock(&loader->lock);
+	end = loader->state == FPGA_STATE_RUNNING ? jiffies : loader->end;
+	size = scnprintf(status, FPGA_STATUS_SIZE,
+		"state=%s bytes=%d total=%d elapsed_ms=%u result=%d\n",
+		fpga_state_names[loader->state],
+		loader->bytes,
+		loader->state == FPGA_STATE_RUNNING ? loader->length : loader->bytes,
+		loader->state == FPGA_STATE_IDLE ? 0 : jiffies_to_msecs(end - loader->start),
+		loader->result);
+	mutex_unlock(&loader->lock);
+
+	return simple_read_from_buffer(buffer, length, offset, status, size);
+}
+
+/* Readable whenever no download is in flight */
+static unsigned int fpga_status_poll(struct file *filp, poll_table *wait)
+{
+	struct fpga_loader *loader = filp->private_data;
+
+	poll_wait(filp, &loader->wait, wait);
+	if(ACCESS_ONCE(loader->state) != FPGA_STATE_RUNNING)
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static void eint_interval_add(struct eint_interval *interval, u64 ns)
+{
+	interval->last = ns;
+	if(!interval->min || ns < interval->min)
+		interval->min = ns;
+	if(ns > interval->max)
+		interval->max = ns;
+}
+
+static irqreturn_t eint_interrupt(int irq, void *dev_id)
+{
+   struct eint_line *line = dev_id;
+   u64 now;
+
+   line->count++;
+   if(line->mode == EINT_MODE_EVENTS) {
+       wake_up_interruptible(&line->wait);
+       return IRQ_HANDLED;
+   }
+
+   // the pin level after the edge tells rising from falling
+   now = ktime_to_ns(ktime_get());
+   spin_lock(&line->lock);
+   line->edges++;
+   if(at91_get_gpio_value(line->pin)) {
+       if(line->rise)
+           eint_interval_add(&line->period, now - line->rise);
+       line->rise = now;
+       line->high = 1;
+   } else if(line->high) {
+       eint_interval_add(&line->width, now - line->rise);
+       line->high = 0;
+   }
+   spin_unlock(&line->lock);
+   return IRQ_HANDLED;
+}
+
+static int eint_open(struct inode *inode, struct file *file)
+{
+	struct eint_reader *reader;
+
+	reader = kmalloc(sizeof(*reader), GFP_KERNEL);
+	if(reader == NULL)
+		return -ENOMEM;
+	reader->line = inode->i_private;
+	reader->seen = ACCESS_ONCE(reader->line->count);
+	file->private_data = reader;
+	return nonseekable_open(inode, file);
+}
+
+static int eint_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+/*
+ * Sleep until the line has seen an edge since this file last returned,
+ * then report the total edge count as one text line. O_NONBLOCK readers
+ * get -EAGAIN instead of sleeping.
+ */
+static ssize_t eint_read(struct file *filp,
+	char *buffer,
+	size_t length,
+	loff_t *offset)
+{
+	struct eint_reader *reader = filp->private_data;
+	struct eint_line *line = reader->line;
+	char count[EINT_COUNT_SIZE];
+	unsigned int now;
+	int size;
+
+	while((now = ACCESS_ONCE(line->count)) == reader->seen) {
+		if(filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if(wait_event_interruptible(line->wait,
+				ACCESS_ONCE(line->count) != reader->seen))
+			return -ERESTARTSYS;
+	}
+
+	size = scnprintf(count, EINT_COUNT_SIZE, "%u\n", now);
+	if(length < size)
+		return -EINVAL;
+	if(copy_to_user(buffer, count, size))
+		return -EFAULT;
+	reader->seen = now;
+	return size;
+}
+
+/* Any write acknowledges the edges seen so far without reading them */
+static ssize_t eint_write(struct file *filp,
+	const char *buffer,
+	size_t length,
+	loff_t *offset)
+{
+	struct eint_reader *reader = filp->private_data;
+
+	reader->seen = ACCESS_ONCE(reader->line->count);
+	return length;
+}
+
+static unsigned int eint_poll(struct file *filp, poll_table *wait)
+{
+	struct eint_reader *reader = filp->private_data;
+
+	poll_wait(filp, &reader->line->wait, wait);
+	if(ACCESS_ONCE(reader->line->count) != reader->seen)
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static void eint_reset_stats(struct eint_line *line)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&line->lock, flags);
+	line->reset = ktime_to_ns(ktime_get());
+	line->rise = 0;
+	line->high = 0;
+	line->edges = 0;
+	memset(&line->period, 0, sizeof(line->period));
+	memset(&line->width, 0, sizeof(line->width));
+	spin_unlock_irqrestore(&line->lock, flags);
+}
+
+static int eint_stats_open(struct inode *inode, struct file *file)
+{
+	file->private_data = inode->i_private;
+	return 0;
+}
+
+/* Edges and intervals since the last reset, all times in ns */
+static ssize_t eint_stats_read(struct file *filp,
+	char *buffer,
+	size_t length,
+	loff_t *offset)
+{
+	struct eint_line *line = filp->private_data;
+	struct eint_interval period, width;
+	char stats[EINT_STATS_SIZE];
+	unsigned long flags;
+	unsigned int edges;
+	u64 elapsed;
+	int size;
+
+	spin_lock_irqsave(&line->lock, flags);
+	edges = line->edges;
+	period = line->period;
+	width = line->width;
+	elapsed = ktime_to_ns(ktime_get()) - line->reset;
+	spin_unlock_irqrestore(&line->lock, flags);
+
+	size = scnprintf(stats, EINT_STATS_SIZE,
+		"edges=%u elapsed=%llu period_last=%llu period_min=%llu period_max=%llu "
+		"width_last=%llu width_min=%llu width_max=%llu\n",
+		edges, elapsed,
+		period.last, period.min, period.max,
+		width.last, width.min, width.max);
+
+	return simple_read_from_buffer(buffer, length, offset, stats, size);
+}
+
+/* Any write clears the statistics */
+static ssize_t eint_stats_write(struct file *filp,
+	const char *buffer,
+	size_t length,
+	loff_t *offset)
+{
+	eint_reset_stats(filp->private_data);
+	return length;
+}
+
+static int eint_mode_get(void *data, u64 *val)
+{
+	struct eint_line *line = data;
+
+	*val = line->mode;
+	return 0;
+}
+
+/* 0: wake EINTn readers on every edge, 1: only count and time edges */
+static int eint_mode_set(void *data, u64 val)
+{
+	struct eint_line *line = data;
+
+	if(val > EINT_MODE_COUNTER)
+		return -EINVAL;
+	if(val == EINT_MODE_COUNTER)
+		eint_reset_stats(line);
+	line->mode = val;
+	// readers blocked during counter mode see the edges they missed
+	wake_up_interruptible(&line->wait);
+	return 0;
+}
+
+static void lophilo_eint_init(struct lophilo_board *board)
+{
+	struct eint_line *line;
+	int i, ret;
+
+	for(i=0; i<board->desc->nr_eint; i++) {
+		line = &board->eint[i];
+		line->pin = board->desc->eint[i];
+
+		/** Set pin as GPIO input, without internal pull up, with deglitch */
+		at91_set_GPIO_periph(line->pin, 0);
+		if(at91_set_gpio_input(line->pin, 0)) {
+			printk(KERN_ERR"Could not set pin %i for GPIO input.\n", line->pin);
+		}
+		if(at91_set_deglitch(line->pin, 1)) {
+			printk(KERN_ERR"Could not set pin %i for GPIO deglitch.\n", line->pin);
+		}
+
+		/** Request IRQ for pin */
+		if((ret = request_irq(line->pin, eint_interrupt, IRQ_TYPE_EDGE_BOTH, "irq_interrupt", line)))  {
+			printk(KERN_ERR"Can't register IRQ %d, mode %d\n", line->pin, IRQ_TYPE_EDGE_BOTH);
+			printk(KERN_ERR"ret = %d\n", ret);
+			continue;
+		}
+		line->requested = 1;
+	}
+}
+
+static void telemetry_work(struct work_struct *work)
+{
+	struct telemetry *telemetry = container_of(to_delayed_work(work), struct telemetry, work);
+	struct telemetry_reg *reg;
+	struct lophilo_delta delta;
+	int i, queued = 0;
+	u32 value;
+
+	mutex_lock(&telemetry->lock);
+	delta.timestamp = ktime_to_ns(ktime_get());
+	delta.reserved = 0;
+	for(i=0; i<telemetry->nr_regs; i++) {
+		reg = &telemetry->regs[i];
+		value = lophilo_ioread(reg->vaddr, reg->width);
+		if(reg->sampled && value == reg->value)
+			continue;
+
+		delta.offset = reg->offset;
+		delta.old_value = reg->sampled ? reg->value : value;
+		delta.new_value = value;
+		delta.window = reg->window;
+		delta.width = reg->width;
+		reg->value = value;
+		reg->sampled = 1;
+
+		if(kfifo_avail(&telemetry->fifo) < sizeof(delta)) {
+			telemetry->dropped++;
+			continue;
+		}
+		kfifo_in(&telemetry->fifo, &delta, sizeof(delta));
+		queued = 1;
+	}
+	if(telemetry->period_ms)
+		schedule_delayed_work(&telemetry->work, msecs_to_jiffies(telemetry->period_ms));
+	mutex_unlock(&telemetry->lock);
+
+	if(queued)
+		wake_up_interruptible(&telemetry->wait);
+}
+
+static int telemetry_open(struct inode *inode, struct file *file)
+{
+	file->private_data = inode->i_private;
+	return nonseekable_open(inode, file);
+}
+
+/*
+ * Add one watch line. Lines use the registry format
+ * "<sys|mod> <size> <parent> <name> <offset>", so registry entries can be
+ * written back as they are; "clear" empties the watch list.
+ */
+static int telemetry_watch_line(struct lophilo_board *board, char *line)
+{
+	struct telemetry *telemetry = &board->telemetry;
+	struct telemetry_reg *reg;
+	struct subsystem *window;
+	char type[4];
+	unsigned int size, offset;
+
+	line = strim(line);
+	if(*line == '\0')
+		return 0;
+	if(!strcmp(line, "clear")) {
+		telemetry->nr_regs = 0;
+		return 0;
+	}
+
+	if(sscanf(line, "%3s %u %*s %*s %u", type, &size, &offset) != 3)
+		return -EINVAL;
+	if(!strcmp(type, "sys"))
+		window = &board->sys_subsystem;
+	else if(!strcmp(type, "mod"))
+		window = &board->mod_subsystem;
+	else
+		return -EINVAL;
+	if((size != 8 && size != 16 && size != 32) ||
+	   offset % (size / 8) ||
+	   offset >= window->size ||
+	   size / 8 > window->size - offset)
+		return -EINVAL;
+
+	if(telemetry->nr_regs == MAX_TELEMETRY_REGS)
+		return -ENOSPC;
+	reg = &telemetry->regs[telemetry->nr_regs++];
+	reg->vaddr = window->vaddr + offset;
+	reg->offset = offset;
+	reg->window = window->id == SYS_SUBSYSTEM_ID ? LOPHILO_WINDOW_SYS : LOPHILO_WINDOW_MOD;
+	reg->width = size;
+	reg->sampled = 0;
+	return 0;
+}
+
+static ssize_t telemetry_watch_write(struct file *filp,
+	const char *buffer,
+	size_t length,
+	loff_t *offset)
+{
+	struct lophilo_board *board = filp->private_data;
+	struct telemetry *telemetry = &board->telemetry;
+	size_t i;
+	char c;
+	int ret = 0;
+
+	mutex_lock(&telemetry->lock);
+	for(i=0; i<length; i++) {
+		if(get_user(c, buffer + i)) {
+			ret = -EFAULT;
+			break;
+		}
+		if(c != '\n') {
+			if(telemetry->line_length == TELEMETRY_LINE_SIZE - 1) {
+				ret = -EINVAL;
+				break;
+			}
+			telemetry->line[telemetry->line_length++] = c;
+			continue;
+		}
+		telemetry->line[telemetry->line_length] = '\0';
+		telemetry->line_length = 0;
+		ret = telemetry_watch_line(board, telemetry->line);
+		if(ret)
+			break;
+	}
+	if(ret)
+		telemetry->line_length = 0;
+	mutex_unlock(&telemetry->lock);
+
+	return ret ? ret : length;
+}
+
+/* A last line without a trailing newline is taken on close */
+static int telemetry_watch_release(struct inode *inode, struct file *file)
+{
+	struct lophilo_board *board = file->private_data;
+	struct telemetry *telemetry = &board->telemetry;
+
+	mutex_lock(&telemetry->lock);
+	if(telemetry->line_length) {
+		telemetry->line[telemetry->line_length] = '\0';
+		telemetry->line_length = 0;
+		telemetry_watch_line(board, telemetry->line);
+	}
+	mutex_unlock(&telemetry->lock);
+	return 0;
+}
+
+static ssize_t telemetry_stream_read(struct file *filp,
+	char *buffer,
+	size_t length,
+	loff_t *offset)
+{
+	struct lophilo_board *board = filp->private_data;
+	struct telemetry *telemetry = &board->telemetry;
+	unsigned int copied;
+	int ret;
+
+	// only whole records are handed out
+	length -= length % sizeof(struct lophilo_delta);
+	if(!length)
+		return -EINVAL;
+
+	while(kfifo_is_empty(&telemetry->fifo)) {
+		if(filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if(wait_event_interruptible(telemetry->wait,
+				!kfifo_is_empty(&telemetry->fifo)))
+			return -ERESTARTSYS;
+	}
+
+	mutex_lock(&telemetry->lock);
+	ret = kfifo_to_user(&telemetry->fifo, buffer, length, &copied);
+	mutex_unlock(&telemetry->lock);
+
+	return ret ? ret : copied;
+}
+
+static unsigned int telemetry_stream_poll(struct file *filp, poll_table *wait)
+{
+	struct lophilo_board *board = filp->private_data;
+	struct telemetry *telemetry = &board->telemetry;
+
+	poll_wait(filp, &telemetry->wait, wait);
+	if(!kfifo_is_empty(&telemetry->fifo))
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static int telemetry_period_get(void *data, u64 *val)
+{
+	struct telemetry *telemetry = data;
+
+	*val = telemetry->period_ms;
+	return 0;
+}
+
+/* 0 stops sampling; any other value (re)starts it with a fresh baseline */
+static int telemetry_period_set(void *data, u64 val)
+{
+	struct telemetry *telemetry = data;
+	int i;
+
+	mutex_lock(&telemetry->lock);
+	telemetry->period_ms = 0;
+	mutex_unlock(&telemetry->lock);
+	cancel_delayed_work_sync(&telemetry->work);
+
+	mutex_lock(&telemetry->lock);
+	// the fifo is only allocated once sampling is first started
+	if(val && !kfifo_initialized(&telemetry->fifo) &&
+	   kfifo_alloc(&telemetry->fifo, TELEMETRY_FIFO_SIZE, GFP_KERNEL)) {
+		mutex_unlock(&telemetry->lock);
+		return -ENOMEM;
+	}
+	telemetry->period_ms = val;
+	for(i=0; i<telemetry->nr_regs; i++)
+		telemetry->regs[i].sampled = 0;
+	if(telemetry->period_ms)
+		schedule_delayed_work(&telemetry->work, 0);
+	mutex_unlock(&telemetry->lock);
+	return 0;
+}
+
+static void lophilo_telemetry_init(struct lophilo_board *board)
+{
+	struct telemetry *telemetry = &board->telemetry;
+
+	telemetry->dentry = debugfs_create_dir("telemetry", board->lophilo_dentry);
+	debugfs_create_file(
+		"watch",
+		S_IWUSR | S_IWGRP | S_IWOTH,
+		telemetry->dentry,
+		board,
+		&fops_telemetry_watch);
+	debugfs_create_file(
+		"stream",
+		S_IRUSR | S_IRGRP | S_IROTH,
+		telemetry->dentry,
+		board,
+		&fops_telemetry_stream);
+	debugfs_create_file(
+		"period_ms",
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH,
+		telemetry->dentry,
+		telemetry,
+		&fops_telemetry_period);
+	debugfs_create_u32(
+		"dropped",
+		S_IRUSR | S_IRGRP | S_IROTH,
+		telemetry->dentry,
+		&telemetry->dropped);
+}
+
+/* Blend two srgb words byte by byte, step/steps of the way from a to b */
+static u32 ledfx_blend(u32 a, u32 b, u32 step, u32 steps)
+{
+	u32 srgb = 0;
+	int shift, from, to;
+
+	for(shift=0; shift<32; shift+=8) {
+		from = (a >> shift) & 0xff;
+		to = (b >> shift) & 0xff;
+		srgb |= (u32) (from + (to - from) * (int) step / (int) steps) << shift;
+	}
+	return srgb;
+}
+
+static enum hrtimer_restart ledfx_tick(struct hrtimer *timer)
+{
+	struct ledfx *ledfx = container_of(timer, struct ledfx, timer);
+	struct lophilo_board *board = container_of(ledfx, struct lophilo_board, ledfx);
+	struct subsystem *sys = &board->sys_subsystem;
+	struct lophilo_led_frame *cur, *next;
+	int i;
+
+	cur = &ledfx->front[ledfx->frame];
+	if(ledfx->frame + 1 < ledfx->nr_front)
+		next = cur + 1;
+	else
+		next = ledfx->loop ? &ledfx->front[0] : cur;
+	for(i=0; i<LOPHILO_NR_LEDS; i++)
+		lophilo_modify(sys, sys->vaddr + 0x100 + 0x4 * i, 32, LOPHILO_OP_WRITE,
+			ledfx_blend(cur->srgb[i], next->srgb[i], ledfx->step, ledfx->fade + 1));
+
+	if(++ledfx->step > ledfx->fade) {
+		ledfx->step = 0;
+		if(++ledfx->frame == ledfx->nr_front) {
+			ledfx->frame = 0;
+			if(!ledfx->loop) {
+				// hold the last frame
+				ledfx->playing = 0;
+				return HRTIMER_NORESTART;
+			}
+		}
+	}
+	hrtimer_forward_now(timer, ledfx->period);
+	return HRTIMER_RESTART;
+}
+
+/* Called with the timer stopped once a setting changed */
+static void ledfx_resume(struct ledfx *ledfx)
+{
+	ledfx->period = ns_to_ktime(NSEC_PER_SEC / (ledfx->fps * (ledfx->fade + 1)));
+	if(ledfx->playing && ledfx->nr_front)
+		hrtimer_start(&ledfx->timer, ktime_set(0, 0), HRTIMER_MODE_REL);
+}
+
+/* Each open for writing starts a new upload */
+static int ledfx_frames_open(struct inode *inode, struct file *file)
+{
+	struct ledfx *ledfx = inode->i_private;
+
+	if(file->f_mode & FMODE_WRITE) {
+		mutex_lock(&ledfx->lock);
+		ledfx->nr_back = 0;
+		mutex_unlock(&ledfx->lock);
+	}
+	file->private_data = ledfx;
+	return nonseekable_open(inode, file);
+}
+
+static ssize_t ledfx_frames_write(struct file *filp,
+	const char *buffer,
+	size_t length,
+	loff_t *offset)
+{
+	struct ledfx *ledfx = filp->private_data;
+	size_t count = length / sizeof(struct lophilo_led_frame);
+
+	if(length % sizeof(struct lophilo_led_frame))
+		return -EINVAL;
+
+	mutex_lock(&ledfx->lock);
+	if(count > MAX_LEDFX_FRAMES - ledfx->nr_back) {
+		mutex_unlock(&ledfx->lock);
+		return -ENOSPC;
+	}
+	if(copy_from_user(&ledfx->back[ledfx->nr_back], buffer, length)) {
+		mutex_unlock(&ledfx->lock);
+		return -EFAULT;
+	}
+	ledfx->nr_back += count;
+	mutex_unlock(&ledfx->lock);
+	return length;
+}
+
+/* Swap the uploaded frames in and play them from the start */
+static int ledfx_commit(void *data, u64 val)
+{
+	struct ledfx *ledfx = data;
+	struct lophilo_led_frame *frames;
+
+	mutex_lock(&ledfx->lock);
+	if(!ledfx->nr_back) {
+		mutex_unlock(&ledfx->lock);
+		return -ENODATA;
+	}
+	hrtimer_cancel(&ledfx->timer);
+	frames = ledfx->front;
+	ledfx->front = ledfx->back;
+	ledfx->back = frames;
+	ledfx->nr_front = ledfx->nr_back;
+	ledfx->nr_back = 0;
+	ledfx->frame = 0;
+	ledfx->step = 0;
+	ledfx->playing = 1;
+	ledfx_resume(ledfx);
+	mutex_unlock(&ledfx->lock);
+	return 0;
+}
+
+static int ledfx_playing_get(void *data, u64 *val)
+{
+	struct ledfx *ledfx = data;
+
+	*val = ledfx->playing;
+	return 0;
+}
+
+/* 0 pauses on the current step, anything else resumes */
+static int ledfx_playing_set(void *data, u64 val)
+{
+	struct ledfx *ledfx = data;
+
+	mutex_lock(&ledfx->lock);
+	hrtimer_cancel(&ledfx->timer);
+	ledfx->playing = val && ledfx->nr_front;
+	ledfx_resume(ledfx);
+	mutex_unlock(&ledfx->lock);
+	return 0;
+}
+
+static int ledfx_fps_get(void *data, u64 *val)
+{
+	struct ledfx *ledfx = data;
+
+	*val = ledfx->fps;
+	return 0;
+}
+
+static int ledfx_fps_set(void *data, u64 val)
+{
+	struct ledfx *ledfx = data;
+
+	mutex_lock(&ledfx->lock);
+	// bound val first so the product can't wrap
+	if(!val || val > LEDFX_MAX_RATE ||
+	   val * ((u64) ledfx->fade + 1) > LEDFX_MAX_RATE) {
+		mutex_unlock(&ledfx->lock);
+		return -EINVAL;
+	}
+	hrtimer_cancel(&ledfx->timer);
+	ledfx->fps = val;
+	ledfx_resume(ledfx);
+	mutex_unlock(&ledfx->lock);
+	return 0;
+}
+
+static int ledfx_fade_get(void *data, u64 *val)
+{
+	struct ledfx *ledfx = data;
+
+	*val = ledfx->fade;
+	return 0;
+}
+
+/* Number of blended steps shown between two frames; 0 cuts */
+static int ledfx_fade_set(void *data, u64 val)
+{
+	struct ledfx *ledfx = data;
+
+	mutex_lock(&ledfx->lock);
+	if(val >= LEDFX_MAX_RATE ||
+	   (u64) ledfx->fps * (val + 1) > LEDFX_MAX_RATE) {
+		mutex_unlock(&ledfx->lock);
+		return -EINVAL;
+	}
+	hrtimer_cancel(&ledfx->timer);
+	ledfx->fade = val;
+	if(ledfx->step > ledfx->fade)
+		ledfx->step = 0;
+	ledfx_resume(ledfx);
+	mutex_unlock(&ledfx->lock);
+	return 0;
+}
+
+static int ledfx_loop_get(void *data, u64 *val)
+{
+	struct ledfx *ledfx = data;
+
+	*val = ledfx->loop;
+	return 0;
+}
+
+static int ledfx_loop_set(void *data, u64 val)
+{
+	struct ledfx *ledfx = data;
+
+	mutex_lock(&ledfx->lock);
+	hrtimer_cancel(&ledfx->timer);
+	ledfx->loop = !!val;
+	ledfx_resume(ledfx);
+	mutex_unlock(&ledfx->lock);
+	return 0;
+}
+
+static void lophilo_ledfx_init(struct lophilo_board *board)
+{
+	struct ledfx *ledfx = &board->ledfx;
+
+	ledfx->dentry = debugfs_create_dir("ledfx", board->lophilo_dentry);
+	debugfs_create_file(
+		"frames",
+		S_IWUSR | S_IWGRP | S_IWOTH,
+		ledfx->dentry,
+		ledfx,
+		&fops_ledfx_frames);
+	debugfs_create_file(
+		"commit",
+		S_IWUSR | S_IWGRP | S_IWOTH,
+		ledfx->dentry,
+		ledfx,
+		&fops_ledfx_commit);
+	debugfs_create_file(
+		"playing",
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH,
+		ledfx->dentry,
+		ledfx,
+		&fops_ledfx_playing);
+	debugfs_create_file(
+		"fps",
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH,
+		ledfx->dentry,
+		ledfx,
+		&fops_ledfx_fps);
+	debugfs_create_file(
+		"fade",
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH,
+		ledfx->dentry,
+		ledfx,
+		&fops_ledfx_fade);
+	debugfs_create_file(
+		"loop",
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH,
+		ledfx->dentry,
+		ledfx,
+		&fops_ledfx_loop);
+	debugfs_create_u32(
+		"length",
+		S_IRUSR | S_IRGRP | S_IROTH,
+		ledfx->dentry,
+		&ledfx->nr_front);
+}
+
+/*
+ * Hand out whole records, one CPU's ring after the other; records are only
+ * ordered within a CPU, so consumers sort by timestamp.
+ */
+static ssize_t trace_read(struct file *filp,
+	char *buffer,
+	size_t length,
+	loff_t *offset)
+{
+	struct trace_ring *ring;
+	size_t record_size = sizeof(struct lophilo_trace_record);
+	size_t done = 0;
+	u32 head, first, count;
+	int cpu;
+
+	length -= length % record_size;
+	if(!length)
+		return -EINVAL;
+
+	mutex_lock(&trace_lock);
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(trace_rings, cpu);
+		head = ACCESS_ONCE(ring->head);
+		smp_rmb();
+		while(ring->tail != head && done < length) {
+			first = ring->tail & (trace_size - 1);
+			count = min_t(u32, head - ring->tail, trace_size - first);
+			count = min_t(u32, count, (length - done) / record_size);
+			if(copy_to_user(buffer + done, &ring->records[first], count * record_size)) {
+				mutex_unlock(&trace_lock);
+				return done ? done : -EFAULT;
+			}
+			done += count * record_size;
+			smp_mb();
+			ring->tail += count;
+		}
+	}
+	mutex_unlock(&trace_lock);
+	return done;
+}
+
+static int trace_enabled_get(void *data, u64 *val)
+{
+	*val = trace_enabled;
+	return 0;
+}
+
+static int trace_enabled_set(void *data, u64 val)
+{
+	trace_enabled = !!val;
+	return 0;
+}
+
+static int trace_dropped_get(void *data, u64 *val)
+{
+	int cpu;
+
+	*val = 0;
+	for_each_possible_cpu(cpu)
+		*val += per_cpu_ptr(trace_rings, cpu)->dropped;
+	return 0;
+}
+
+/* The rings are shared by all boards and exposed through the first one */
+static void lophilo_trace_files(struct lophilo_board *board)
+{
+	struct dentry *dentry;
+
+	dentry = debugfs_create_dir("trace", board->lophilo_dentry);
+	debugfs_create_file(
+		"data",
+		S_IRUSR | S_IRGRP | S_IROTH,
+		dentry,
+		NULL,
+		&fops_trace);
+	debugfs_create_file(
+		"enabled",
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH,
+		dentry,
+		NULL,
+		&fops_trace_enabled);
+	debugfs_create_file(
+		"dropped",
+		S_IRUSR | S_IRGRP | S_IROTH,
+		dentry,
+		NULL,
+		&fops_trace_dropped);
+}
+
+static int lophilo_trace_alloc(void)
+{
+	struct trace_ring *ring;
+	int cpu;
+
+	trace_size = roundup_pow_of_two(trace_records);
+	trace_rings = alloc_percpu(struct trace_ring);
+	if(trace_rings == NULL)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(trace_rings, cpu);
+		ring->records = vmalloc(trace_size * sizeof(struct lophilo_trace_record));
+		if(ring->records == NULL)
+			return -ENOMEM;
+	}
+	trace_enabled = 1;
+	return 0;
+}
+
+static void lophilo_trace_free(void)
+{
+	int cpu;
+
+	trace_enabled = 0;
+	if(trace_rings == NULL)
+		return;
+	for_each_possible_cpu(cpu)
+		vfree(per_cpu_ptr(trace_rings, cpu)->records);
+	free_percpu(trace_rings);
+	trace_rings = NULL;
+}
+
+static void lophilo_board_free(struct lophilo_board *board)
+{
+	int i;
+
+	debugfs_remove_recursive(board->lophilo_dentry);
+	hrtimer_cancel(&board->ledfx.timer);
+	board->telemetry.period_ms = 0;
+	cancel_delayed_work_sync(&board->telemetry.work);
+	kfifo_free(&board->telemetry.fifo);
+	debugfs_remove_recursive(board->fpga_dentry);
+	for(i=0; i<board->desc->nr_eint; i++) {
+		if(board->eint[i].requested)
+			free_irq(board->eint[i].pin, &board->eint[i]);
+	}
+	kfree(board->loader.buffer);
+	release_firmware(board->loader.firmware);
+	if(board->pdev)
+		platform_device_unregister(board->pdev);
+	vfree(board);
+}
+
+static struct lophilo_board *
+lophilo_board_alloc(int index)
+{
+	struct lophilo_board *board;
+	const struct board_desc *desc = &board_descs[index];
+	int i;
+
+	// registry, register files and LED frames make this too big for kmalloc
+	board = vzalloc(sizeof(*board));
+	if(board == NULL)
+		return NULL;
+
+	board->index = index;
+	board->desc = desc;
+
+	board->sys_subsystem.id = SYS_SUBSYSTEM_ID;
+	board->sys_subsystem.size = 0x204;
+	board->sys_subsystem.paddr = desc->sys_paddr;
+	board->sys_subsystem.vaddr = (u32) *desc->sys_base;
+
+	board->mod_subsystem.id = MOD_SUBSYSTEM_ID;
+	board->mod_subsystem.paddr = desc->mod_paddr;
+	board->mod_subsystem.vaddr = (u32) *desc->mod_base;
+
+	board->fpga_data.id = FPGA_DATA_ID;
+	board->fpga_download.id = FPGA_DOWNLOAD_ID;
+
+	board->sys_subsystem.board = board;
+	board->mod_subsystem.board = board;
+	spin_lock_init(&board->sys_subsystem.lock);
+	spin_lock_init(&board->mod_subsystem.lock);
+	board->fpga_data.board = board;
+	board->fpga_download.board = board;
+
+	for(i=0; i<MAX_EINT; i++) {
+		board->eint[i].id = i;
+		init_waitqueue_head(&board->eint[i].wait);
+		spin_lock_init(&board->eint[i].lock);
+	}
+
+	board->registry_blob.data = board->registry;
+	board->registry_blob.size = 0;
+
+	INIT_WORK(&board->loader.work, fpga_download_work);
+	mutex_init(&board->loader.lock);
+	init_waitqueue_head(&board->loader.wait);
+	board->loader.pins = &desc->fpga;
+
+	INIT_DELAYED_WORK(&board->telemetry.work, telemetry_work);
+	mutex_init(&board->telemetry.lock);
+	init_waitqueue_head(&board->telemetry.wait);
+
+	hrtimer_init(&board->ledfx.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	board->ledfx.timer.function = ledfx_tick;
+	mutex_init(&board->ledfx.lock);
+	board->ledfx.front = board->ledfx.frames[0];
+	board->ledfx.back = board->ledfx.frames[1];
+	board->ledfx.fps = 30;
+	board->ledfx.loop = 1;
+
+	return board;
+}
+
+/* Walk the mod window and create debugfs entries for every subsystem found */
+static int lophilo_discover(struct lophilo_board *board)
+{
+	struct dentry *lophilo_subsystem_dentry;
+	struct subsystem *subsystems = board->subsystems;
+	int subsystem_id = 0;
+	void* current_addr;
+	void* mod_base = (void*) board->mod_subsystem.vaddr;
+	u8 pwm_id = 0;
+	u8 gpio_id = 0;
+
+	current_addr = mod_base;
+
+	while(true) {
+		if(subsystem_id == MAX_SUBSYSTEMS) {
 			printk(KERN_INFO "Lophilo ended detection, maximum found %d\n",
 				MAX_SUBSYSTEMS);
 			break;
 		}
 
 		subsystems[subsystem_id].id = ioread32(current_addr + 0x4);
-		subsystems[subsystem_id].offset = current_addr - fpga_cs1_base;
+		subsystems[subsystem_id].offset = current_addr - mod_base;
+		subsystems[subsystem_id].board = board;
+		spin_lock_init(&subsystems[subsystem_id].lock);
 
 		if((subsystems[subsystem_id].id & 0xea000000) == 0xea000000) {
-			printk(KERN_INFO "Lophilo adding subsystem 0x%x of type 0x%x at 0x%x\n",
-				subsystem_id, subsystems[subsystem_id].id, (u32)current_addr);
+			printk(KERN_INFO "Lophilo %d adding subsystem 0x%x of type 0x%x at 0x%x\n",
+				board->index, subsystem_id, subsystems[subsystem_id].id, (u32)current_addr);
 		} else {
-			printk(KERN_INFO "Lophilo ended detection, found 0x%x\n",
-				subsystems[subsystem_id].id);
+			printk(KERN_INFO "Lophilo %d ended detection, found 0x%x\n",
+				board->index, subsystems[subsystem_id].id);
 			break;
 		}
 
 		subsystems[subsystem_id].vaddr = (u32) current_addr;
-		subsystems[subsystem_id].paddr = MOD_PHYS_ADDR;
+		subsystems[subsystem_id].paddr = board->mod_subsystem.paddr;
 
 		subsystems[subsystem_id].size = ioread32(current_addr);
 		if(subsystems[subsystem_id].size < 4) {
@@ -647,15 +2156,17 @@ lophilo_init(void)
 		switch(subsystems[subsystem_id].id) {
 			case GPIO_SUBSYSTEM:
 				lophilo_subsystem_dentry = create_channel_gpio(
+					board,
 					gpio_id++,
-					lophilo_dentry,
-					subsystems[subsystem_id].vaddr);
+					board->lophilo_dentry,
+					&subsystems[subsystem_id]);
 				break;
 			case PWM_SUBSYSTEM:
 				lophilo_subsystem_dentry = create_channel_pwm(
+					board,
 					pwm_id++,
-					lophilo_dentry,
-					subsystems[subsystem_id].vaddr);
+					board->lophilo_dentry,
+					&subsystems[subsystem_id]);
 				break;
 			default:
 				printk(KERN_ERR "Unsupported file system id %d", subsystems[subsystem_id].id);
@@ -683,16 +2194,221 @@ lophilo_init(void)
 
 
 		current_addr += subsystems[subsystem_id].size;
-		mod_subsystem.size += subsystems[subsystem_id].size;
 		//printk(KERN_INFO "current_addr increment to 0x%x for subsystem 0x%x", current_addr, subsystem_id);
 		subsystem_id++;
+		// modmem is live: publish the block before the window grows over it,
+		// so an op that passes the size check finds its lock (lophilo_apply_op)
+		smp_wmb();
+		board->nr_subsystems = subsystem_id;
+		smp_wmb();
+		board->mod_subsystem.size += subsystems[subsystem_id - 1].size;
 	}
 
 	debugfs_create_blob(
 		"registry",
 		S_IRWXU | S_IRWXG | S_IRWXO,
-		lophilo_dentry,
-		&registry_blob);
+		board->lophilo_dentry,
+		&board->registry_blob);
+	return 0;
+}
+
+static int lophilo_board_init(struct lophilo_board *board)
+{
+	char dir_name[MAX_DIR_NAME];
+	char eint_name[MAX_DIR_NAME];
+	int i;
+
+	// the first board keeps the historical unnumbered names
+	if(board->index)
+		scnprintf(dir_name, MAX_DIR_NAME, "lophilo%d", board->index);
+	else
+		strcpy(dir_name, "lophilo");
+	board->lophilo_dentry = debugfs_create_dir(
+		dir_name,
+		NULL);
+	if(board->lophilo_dentry == NULL) {
+		printk(KERN_ERR "Could not create root directory entry %s in debugfs", dir_name);
+		return -EINVAL;
+	}
+
+	if(board->index)
+		scnprintf(dir_name, MAX_DIR_NAME, "fpga%d", board->index);
+	else
+		strcpy(dir_name, "fpga");
+    board->fpga_dentry = debugfs_create_dir(
+        dir_name,
+        NULL);
+    if(board->fpga_dentry == NULL) {
+        printk(KERN_ERR "Could not create root directory entry %s in debugfs", dir_name);
+        return -EINVAL;
+    }
+
+	lophilo_eint_init(board);
+
+    debugfs_create_file(
+        "data",
+        S_IRWXU | S_IRWXG | S_IRWXO,
+        board->fpga_dentry,
+        &board->fpga_data,
+        &fops_mem
+        );
+    debugfs_create_file(
+        "download",
+        S_IRWXU | S_IRWXG | S_IRWXO,
+        board->fpga_dentry,
+        &board->fpga_download,
+        &fops_mem
+        );
+    debugfs_create_file(
+        "status",
+        S_IRUSR | S_IRGRP | S_IROTH,
+        board->fpga_dentry,
+        &board->loader,
+        &fops_fpga_status
+        );
+	for(i=0; i<board->desc->nr_eint; i++) {
+		scnprintf(eint_name, MAX_DIR_NAME, "EINT%d", i);
+		debugfs_create_file(
+			eint_name,
+			S_IRWXU | S_IRWXG | S_IRWXO,
+			board->lophilo_dentry,
+			&board->eint[i],
+			&fops_eint
+			);
+		scnprintf(eint_name, MAX_DIR_NAME, "EINT%d_mode", i);
+		debugfs_create_file(
+			eint_name,
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH,
+			board->lophilo_dentry,
+			&board->eint[i],
+			&fops_eint_mode
+			);
+		scnprintf(eint_name, MAX_DIR_NAME, "EINT%d_stats", i);
+		debugfs_create_file(
+			eint_name,
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH,
+			board->lophilo_dentry,
+			&board->eint[i],
+			&fops_eint_stats
+			);
+	}
+
+	//fpga = request_mem_region(FPGA_BASE_ADDR, SIZE16MB, "Lophilo FPGA LEDs");
+	create_root(board, board->lophilo_dentry, board->sys_subsystem.vaddr);
+
+	debugfs_create_file(
+		"sysmem",
+		S_IRWXU | S_IRWXG | S_IRWXO,
+		board->lophilo_dentry,
+		&board->sys_subsystem,
+		&fops_mem
+		);
+
+	debugfs_create_file(
+		"modmem",
+		S_IRWXU | S_IRWXG | S_IRWXO,
+		board->lophilo_dentry,
+		&board->mod_subsystem,
+		&fops_mem
+		);
+
+
+	for(i=0; i<LOPHILO_NR_LEDS; i++) {
+		create_led(board, i, board->lophilo_dentry, board->sys_subsystem.vaddr);
+	}
+
+	lophilo_telemetry_init(board);
+	lophilo_ledfx_init(board);
+	if(board->index == 0 && trace_rings)
+		lophilo_trace_files(board);
+
+	// with a firmware image, discovery runs once the download is DONE
+	if(lophilo_preloads(board))
+		return 0;
+	if(firmware[board->index])
+		printk(KERN_WARNING "Lophilo %d has no configuration pins, ignoring firmware %s\n",
+			board->index, firmware[board->index]);
+
+	return lophilo_discover(board);
+}
+
+static void lophilo_free_boards(void)
+{
+	int i;
+
+	for(i=0; i<MAX_BOARDS; i++) {
+		if(boards[i])
+			boards[i]->loader.cancel = 1;
+	}
+	destroy_workqueue(fpga_wq);
+	for(i=0; i<MAX_BOARDS; i++) {
+		if(boards[i]) {
+			lophilo_board_free(boards[i]);
+			boards[i] = NULL;
+		}
+	}
+	lophilo_trace_free();
+}
+
+static int __init
+lophilo_init(void)
+{
+	struct lophilo_board *board;
+	int i, ret;
+
+	printk(KERN_INFO "Lophilo module loading\n");
+
+	if(nr_boards < 1 || nr_boards > MAX_BOARDS) {
+		printk(KERN_ERR "Invalid nr_boards %u, supported 1-%d\n", nr_boards, MAX_BOARDS);
+		return -EINVAL;
+	}
+
+	fpga_wq = alloc_workqueue("lophilo_fpga", WQ_UNBOUND, 0);
+	if(fpga_wq == NULL) {
+		printk(KERN_ERR "Could not allocate FPGA download workqueue");
+		return -ENOMEM;
+	}
+
+	if(trace_records) {
+		ret = lophilo_trace_alloc();
+		if(ret) {
+			printk(KERN_ERR "Could not allocate %u trace records per CPU", trace_records);
+			lophilo_free_boards();
+			return ret;
+		}
+	}
+
+	for(i=0; i<nr_boards; i++) {
+		if(*board_descs[i].sys_base == NULL || *board_descs[i].mod_base == NULL) {
+			printk(KERN_ERR "Lophilo %d: chip selects are not mapped by the platform\n", i);
+			lophilo_free_boards();
+			return -ENODEV;
+		}
+		board = lophilo_board_alloc(i);
+		if(board == NULL) {
+			lophilo_free_boards();
+			return -ENOMEM;
+		}
+		boards[i] = board;
+		ret = lophilo_board_init(board);
+		if(ret) {
+			lophilo_free_boards();
+			return ret;
+		}
+	}
+
+	// only once nothing can fail, so no board is freed under a pending request
+	for(i=0; i<nr_boards; i++) {
+		board = boards[i];
+		if(!lophilo_preloads(board))
+			continue;
+		ret = lophilo_firmware_request(board);
+		if(ret) {
+			printk(KERN_ERR "Lophilo %d could not request firmware %s: %d; discovering now\n",
+				i, firmware[i], ret);
+			lophilo_discover(board);
+		}
+	}
 	return 0;
 }
 
@@ -743,13 +2459,76 @@ void __exit
 lophilo_cleanup(void)
 {
 	printk(KERN_INFO "Lophilo module uninstalling\n");
-	debugfs_remove_recursive(lophilo_dentry);
-	debugfs_remove_recursive(fpga_dentry);
 	//release_mem_region(FPGA_BASE_ADDR, SIZE16MB);
-    free_irq(AT91_PIN_PD10, irq_interrupt_irq0);
+	lophilo_free_boards();
 	return;
 }
 
+/* Lock owner for a register in the sys or mod window */
+static struct subsystem *lophilo_find_subsystem(struct subsystem *window, u32 offset)
+{
+	struct lophilo_board *board = window->board;
+	struct subsystem *subsystem;
+	int i;
+
+	if(window->id == MOD_SUBSYSTEM_ID) {
+		for(i=0; i<board->nr_subsystems; i++) {
+			subsystem = &board->subsystems[i];
+			if(offset >= subsystem->offset &&
+			   offset < subsystem->offset + subsystem->size)
+				return subsystem;
+		}
+	}
+	return window;
+}
+
+static int lophilo_apply_op(struct subsystem *window, struct lophilo_op *op)
+{
+	u32 bytes = op->width / 8;
+	u32 size = ACCESS_ONCE(window->size);
+
+	if((op->width != 8 && op->width != 16 && op->width != 32) ||
+	   op->op > LOPHILO_OP_TGL ||
+	   op->offset % bytes ||
+	   op->offset >= size ||
+	   bytes > size - op->offset)
+		return -EINVAL;
+	// discovery grows modmem after publishing the subsystem that owns it
+	smp_rmb();
+
+	lophilo_modify(lophilo_find_subsystem(window, op->offset),
+		window->vaddr + op->offset, op->width, op->op, op->value);
+	return 0;
+}
+
+/*
+ * Writes to sysmem/modmem carry an array of struct lophilo_op, applied in
+ * order. On a bad entry the ops before it stay applied and their size is
+ * returned.
+ */
+static ssize_t lophilo_write_ops(struct subsystem *window, const char *buffer, size_t length)
+{
+	struct lophilo_op ops[MAX_BATCH_OPS];
+	size_t done = 0;
+	int i, count, ret;
+
+	if(length % sizeof(struct lophilo_op))
+		return -EINVAL;
+
+	while(done < length) {
+		count = min_t(size_t, (length - done) / sizeof(struct lophilo_op), MAX_BATCH_OPS);
+		if(copy_from_user(ops, buffer + done, count * sizeof(struct lophilo_op)))
+			return done ? done : -EFAULT;
+		for(i=0; i<count; i++) {
+			ret = lophilo_apply_op(window, &ops[i]);
+			if(ret)
+				return done ? done : ret;
+			done += sizeof(struct lophilo_op);
+		}
+	}
+	return length;
+}
+
 /* Methods */
 /* Called when a process tries to open the device file, like
  * "cat /dev/mycharfile"
@@ -795,10 +2574,6 @@ static ssize_t device_read(struct file *filp,
    	return 0;
    switch (subsystem_ptr->id)
    {
-	   case IRQ_0_ID:
-		   interruptible_sleep_on(&EINT0);
-		   printk("Read irq 0\n");
-		   break;
 	   default:
 		   /* Actually put the data into the buffer */
 		   while (length && (subsystem_ptr->index < subsystem_ptr->size))  {
@@ -828,37 +2603,56 @@ static ssize_t device_write(struct file *filp,
    loff_t *off)
 {
    struct subsystem* subsystem_ptr = filp->private_data;
+   struct fpga_loader* loader = &subsystem_ptr->board->loader;
+   char command = 0;
+   int ret;
 
    switch (subsystem_ptr->id)
    {
        case FPGA_DATA_ID:
-           if(fpga_download_buffer == NULL)
-               fpga_download_buffer = kmalloc(FPGA_DOWNLOAD_BUFFER_SIZE, GFP_KERNEL);
+           mutex_lock(&loader->lock);
+           if(loader->state == FPGA_STATE_RUNNING) {
+               mutex_unlock(&loader->lock);
+               return -EBUSY;
+           }
+           if(loader->buffer == NULL)
+               loader->buffer = kmalloc(FPGA_DOWNLOAD_BUFFER_SIZE, GFP_KERNEL);
                //buffer for download
-           if((fpga_buffer_index + length) > FPGA_DOWNLOAD_BUFFER_SIZE) {
-               printk("FPGA download buffer overflow");
-               fpga_buffer_index = 0;
-               break;
+           if(loader->buffer == NULL) {
+               mutex_unlock(&loader->lock);
+               return -ENOMEM;
+           }
+           if((loader->length + length) > FPGA_DOWNLOAD_BUFFER_SIZE) {
+               printk("FPGA download buffer overflow\n");
+               // drop the partial image so later chunks can't download a truncated tail
+               loader->length = 0;
+               mutex_unlock(&loader->lock);
+               return -EFBIG;
            }
-           if(copy_from_user(fpga_download_buffer+fpga_buffer_index,buffer,length))
-                return -ENOMEM;
-           fpga_buffer_index += length;
+           if(copy_from_user(loader->buffer+loader->length,buffer,length)) {
+               mutex_unlock(&loader->lock);
+               return -ENOMEM;
+           }
+           loader->length += length;
+           mutex_unlock(&loader->lock);
            break;
        case FPGA_DOWNLOAD_ID:
-           if (fpga_buffer_index) {
-               FPGA_Config(fpga_download_buffer,fpga_buffer_index);
-               kfree(fpga_download_buffer);
-               fpga_download_buffer = NULL;
-               fpga_buffer_index = 0;
-           }
-           else
-           {
-               printk("No data to download\n");
+           // "0" cancels an in-flight download, anything else starts one
+           if(length && get_user(command, buffer))
+               return -EFAULT;
+           if(command == '0') {
+               loader->cancel = 1;
+               break;
            }
+           mutex_lock(&loader->lock);
+           ret = fpga_download_start(loader);
+           mutex_unlock(&loader->lock);
+           if(ret)
+               return ret;
            break;
-       case IRQ_0_ID:
-           printk("Clear irq\n");
-    	   break;
+       case SYS_SUBSYSTEM_ID:
+       case MOD_SUBSYSTEM_ID:
+           return lophilo_write_ops(subsystem_ptr, buffer, length);
        default:
            printk("Not support yet\n");
            break;
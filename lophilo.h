@@ -0,0 +1,81 @@
+/*
+ * Definitions shared between the Lophilo driver and userspace
+ *
+ * Copyright 2012 Lophilo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+#ifndef LOPHILO_H
+#define LOPHILO_H
+
+#include <linux/types.h>
+
+#define LOPHILO_OP_WRITE	0	/* reg = value */
+#define LOPHILO_OP_SET		1	/* reg |= value */
+#define LOPHILO_OP_CLR		2	/* reg &= ~value */
+#define LOPHILO_OP_TGL		3	/* reg ^= value */
+
+/*
+ * One register operation. Writing an array of these to sysmem or modmem
+ * applies them in order in a single call; offset is relative to the start
+ * of that window and width is 8, 16 or 32.
+ */
+struct lophilo_op {
+	__u32 offset;
+	__u32 value;
+	__u8 width;
+	__u8 op;
+	__u16 reserved;
+};
+
+#define LOPHILO_WINDOW_SYS	0	/* sysmem */
+#define LOPHILO_WINDOW_MOD	1	/* modmem */
+
+/*
+ * Record read from lophilo/telemetry/stream: a watched register changed
+ * between two samples. The first sample of a register is reported with
+ * old_value == new_value. timestamp is CLOCK_MONOTONIC in nanoseconds.
+ */
+struct lophilo_delta {
+	__u64 timestamp;
+	__u32 offset;
+	__u32 old_value;
+	__u32 new_value;
+	__u8 window;
+	__u8 width;
+	__u16 reserved;
+};
+
+#define LOPHILO_NR_LEDS		4
+
+/*
+ * One frame written to lophilo/ledfx/frames: the srgb word of every LED,
+ * as in ledN/srgb.
+ */
+struct lophilo_led_frame {
+	__u32 srgb[LOPHILO_NR_LEDS];
+};
+
+/*
+ * Record read from lophilo/trace/data: one register write through any
+ * driver path. value is what was written to the register, after a
+ * set/clear/toggle was applied; pid is 0 for writes the kernel made on
+ * its own (ledfx). timestamp is CLOCK_MONOTONIC in nanoseconds.
+ * Writes through the mmap path never reach the driver; lophilod -t
+ * records its own in this format.
+ */
+struct lophilo_trace_record {
+	__u64 timestamp;
+	__u32 offset;
+	__u32 value;
+	__s32 pid;
+	__u8 board;
+	__u8 window;	/* LOPHILO_WINDOW_* */
+	__u8 width;
+	__u8 op;	/* LOPHILO_OP_* that produced value */
+};
+
+#endif /* LOPHILO_H */
@@ -0,0 +1,752 @@
+/*
+ * lophilo_bench: measure what a register access costs through each of the
+ * interfaces the driver offers
+ *
+ * Usage: lophilo_bench [-s] [-n iterations] [-d lophilo dir] [-F fpga dir]
+ *	[-f bitstream] [-o report.json] [-c baseline.json] [-t tolerance %]
+ *
+ *	-s	run against an in-memory stand-in of the debugfs tree instead
+ *		of the hardware (measures the harness and syscall overhead)
+ *	-f	also time downloading this bitstream; without it the FPGA is
+ *		left alone (the stand-in always times a synthetic image)
+ *	-c	compare against an earlier report and exit with 1 when a
+ *		median latency got worse by more than the tolerance (20%)
+ *
+ * Every workload runs through every path:
+ *
+ *	debugfs		the per-register files (and dout_tgl for the toggle)
+ *	window		sysmem/modmem: one struct lophilo_op batch per iteration,
+ *			a full read of the window for the dump
+ *	mmap		loads and stores on the mapped window, as lophilo_user does
+ *	lophilod	the register daemon, when one is running (not with -s)
+ *
+ * The report is JSON with one result object per line.
+ *
+ * Copyright 2012 Lophilo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "lophilod.h"
+
+#define WINDOW_SIZE	4096
+#define NR_PINS		26
+#define MAX_REGS	512
+#define MAX_PWMS	16
+#define MAX_RESULTS	64
+#define DOWNLOAD_REPS	3
+#define STANDIN_IMAGE	(256 * 1024)
+
+/* one line of the registry */
+struct reg {
+	uint8_t window;
+	uint8_t width;
+	char parent[32];
+	char name[32];
+	uint32_t offset;
+	int fd;
+};
+
+struct result {
+	char path[16];
+	char workload[16];
+	unsigned iterations;
+	unsigned accesses;	/* register accesses per iteration */
+	double per_sec;		/* iterations (download: bytes) per second */
+	uint64_t p50, p99, max;	/* ns per iteration */
+};
+
+enum path { PATH_DEBUGFS, PATH_WINDOW, PATH_MMAP, PATH_LOPHILOD, NR_PATHS };
+enum workload { WL_TOGGLE, WL_SWEEP, WL_PWM, WL_DUMP, NR_WORKLOADS };
+
+static const char *path_names[] = { "debugfs", "window", "mmap", "lophilod" };
+static const char *workload_names[] = { "toggle", "sweep", "pwm", "dump" };
+
+static char lophilo_dir[PATH_MAX] = "/sys/kernel/debug/lophilo";
+static char fpga_dir[PATH_MAX] = "/sys/kernel/debug/fpga";
+static const char *window_names[] = { "sysmem", "modmem" };
+
+static struct reg regs[MAX_REGS];
+static int nr_regs;
+static struct reg *dout, *dout_tgl, *pins[NR_PINS], *pwms[MAX_PWMS][2];
+static int nr_pwms;
+
+static volatile uint8_t *windows[2];
+static struct lophilod_client client;
+static uint64_t *samples;
+
+static struct result results[MAX_RESULTS];
+static int nr_results;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(2);
+}
+
+static int open_in(const char *dir, const char *parent, const char *name, int flags)
+{
+	char path[PATH_MAX];
+
+	// root registers are listed under the parent "lophilo"
+	if(parent && strcmp(parent, "lophilo"))
+		snprintf(path, sizeof(path), "%s/%s/%s", dir, parent, name);
+	else
+		snprintf(path, sizeof(path), "%s/%s", dir, name);
+	return open(path, flags, 0644);
+}
+
+static void write_text(int fd, uint32_t value)
+{
+	char text[16];
+	int len = snprintf(text, sizeof(text), "0x%08x\n", value);
+
+	if(pwrite(fd, text, len, 0) != len)
+		die("write");
+}
+
+static uint32_t read_text(int fd)
+{
+	char text[32];
+	ssize_t len = pread(fd, text, sizeof(text) - 1, 0);
+
+	if(len < 0)
+		die("read");
+	text[len] = 0;
+	return strtoul(text, NULL, 0);
+}
+
+/*
+ * Build a stand-in tree in a temporary directory: the registry of one
+ * GPIO block and four PWMs, a text file per register and 4 KiB window files.
+ */
+static void make_standin(void)
+{
+	static const char *gpio_regs[] = { "dout", "din", "doe", "dout_tgl" };
+	char path[PATH_MAX], name[16];
+	FILE *registry;
+	int fd, i;
+
+	strcpy(lophilo_dir, "/tmp/lophilo_bench.XXXXXX");
+	if(!mkdtemp(lophilo_dir))
+		die("mkdtemp");
+	snprintf(fpga_dir, sizeof(fpga_dir), "%s/fpga", lophilo_dir);
+
+	snprintf(path, sizeof(path), "%s/registry", lophilo_dir);
+	registry = fopen(path, "w");
+	if(!registry)
+		die(path);
+	for(i = 0; i < 3; i++)
+		fprintf(registry, "mod 32 gpio0 %s %u\n", gpio_regs[i], 0x8 + 4 * i);
+	for(i = 0; i < NR_PINS; i++)
+		fprintf(registry, "mod 8 gpio0 io%d %u\n", i, 0x40 + i);
+	for(i = 0; i < 4; i++) {
+		fprintf(registry, "mod 32 pwm%d gate %u\n", i, 0x100 + 0x20 * i + 0xc);
+		fprintf(registry, "mod 32 pwm%d dtyc %u\n", i, 0x100 + 0x20 * i + 0x10);
+	}
+	fclose(registry);
+
+	for(i = 0; i < 4; i++) {
+		snprintf(name, sizeof(name), "pwm%d", i);
+		snprintf(path, sizeof(path), "%s/%s", lophilo_dir, name);
+		mkdir(path, 0755);
+		close(open_in(lophilo_dir, name, "gate", O_CREAT | O_WRONLY));
+		close(open_in(lophilo_dir, name, "dtyc", O_CREAT | O_WRONLY));
+	}
+	snprintf(path, sizeof(path), "%s/gpio0", lophilo_dir);
+	mkdir(path, 0755);
+	for(i = 0; i < 4; i++) {
+		fd = open_in(lophilo_dir, "gpio0", gpio_regs[i], O_CREAT | O_WRONLY);
+		write_text(fd, 0);
+		close(fd);
+	}
+	for(i = 0; i < NR_PINS; i++) {
+		snprintf(name, sizeof(name), "io%d", i);
+		close(open_in(lophilo_dir, "gpio0", name, O_CREAT | O_WRONLY));
+	}
+	for(i = 0; i < 2; i++) {
+		fd = open_in(lophilo_dir, NULL, window_names[i], O_CREAT | O_RDWR);
+		if(fd < 0 || ftruncate(fd, WINDOW_SIZE) < 0)
+			die(window_names[i]);
+		close(fd);
+	}
+
+	mkdir(fpga_dir, 0755);
+	close(open_in(fpga_dir, NULL, "data", O_CREAT | O_WRONLY));
+	close(open_in(fpga_dir, NULL, "download", O_CREAT | O_WRONLY));
+	fd = open_in(fpga_dir, NULL, "status", O_CREAT | O_WRONLY);
+	if(write(fd, "state=done\n", 11) != 11)
+		die("status");
+	close(fd);
+}
+
+static void remove_standin(void)
+{
+	char command[PATH_MAX + 16];
+
+	snprintf(command, sizeof(command), "rm -rf '%s'", lophilo_dir);
+	if(system(command))
+		fprintf(stderr, "lophilo_bench: could not remove %s\n", lophilo_dir);
+}
+
+static struct reg *find_reg(const char *parent, const char *name)
+{
+	int i;
+
+	for(i = 0; i < nr_regs; i++)
+		if(!strcmp(regs[i].parent, parent) && !strcmp(regs[i].name, name))
+			return &regs[i];
+	return NULL;
+}
+
+/* Pick the registers the workloads touch out of the registry */
+static void load_registry(void)
+{
+	static struct reg tgl;
+	char path[PATH_MAX], window[8], name[16];
+	struct reg *reg;
+	FILE *registry;
+	int i;
+
+	snprintf(path, sizeof(path), "%s/registry", lophilo_dir);
+	registry = fopen(path, "r");
+	if(!registry)
+		die(path);
+	while(nr_regs < MAX_REGS) {
+		reg = &regs[nr_regs];
+		if(fscanf(registry, "%7s %hhu %31s %31s %u", window, &reg->width,
+			  reg->parent, reg->name, &reg->offset) != 5)
+			break;
+		reg->window = strcmp(window, "mod") ? LOPHILO_WINDOW_SYS : LOPHILO_WINDOW_MOD;
+		reg->fd = -1;
+		// only the first page of a window can be mapped
+		if(reg->offset + reg->width / 8 <= WINDOW_SIZE)
+			nr_regs++;
+	}
+	fclose(registry);
+
+	dout = find_reg("gpio0", "dout");
+	if(!dout) {
+		fprintf(stderr, "lophilo_bench: no gpio0 in the registry\n");
+		exit(2);
+	}
+	// the bit files are not in the registry
+	tgl = *dout;
+	strcpy(tgl.name, "dout_tgl");
+	dout_tgl = &tgl;
+	for(i = 0; i < NR_PINS; i++) {
+		snprintf(name, sizeof(name), "io%d", i);
+		pins[i] = find_reg("gpio0", name);
+		if(!pins[i]) {
+			fprintf(stderr, "lophilo_bench: no gpio0/%s in the registry\n", name);
+			exit(2);
+		}
+	}
+	for(nr_pwms = 0; nr_pwms < MAX_PWMS; nr_pwms++) {
+		snprintf(name, sizeof(name), "pwm%d", nr_pwms);
+		pwms[nr_pwms][0] = find_reg(name, "gate");
+		pwms[nr_pwms][1] = find_reg(name, "dtyc");
+		if(!pwms[nr_pwms][0] || !pwms[nr_pwms][1])
+			break;
+	}
+}
+
+static int reg_fd(struct reg *reg)
+{
+	if(reg->fd < 0) {
+		reg->fd = open_in(lophilo_dir, reg->parent, reg->name, O_RDWR);
+		if(reg->fd < 0)
+			die(reg->name);
+	}
+	return reg->fd;
+}
+
+static void close_reg_fds(void)
+{
+	int i;
+
+	for(i = 0; i < nr_regs; i++) {
+		if(regs[i].fd >= 0)
+			close(regs[i].fd);
+		regs[i].fd = -1;
+	}
+	if(dout_tgl->fd >= 0)
+		close(dout_tgl->fd);
+	dout_tgl->fd = -1;
+}
+
+/* The window files only allow one opener, so each path opens its own */
+static int open_window(uint8_t window)
+{
+	int fd = open_in(lophilo_dir, NULL, window_names[window], O_RDWR);
+
+	if(fd < 0)
+		die(window_names[window]);
+	return fd;
+}
+
+static void map_windows(void)
+{
+	int fd, i;
+
+	for(i = 0; i < 2; i++) {
+		fd = open_window(i);
+		windows[i] = mmap(NULL, WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if(windows[i] == MAP_FAILED)
+			die("mmap");
+	}
+}
+
+static void unmap_windows(void)
+{
+	int i;
+
+	for(i = 0; i < 2; i++)
+		munmap((void *) windows[i], WINDOW_SIZE);
+}
+
+static uint32_t mmap_read(const struct reg *reg)
+{
+	volatile uint8_t *addr = windows[reg->window] + reg->offset;
+
+	switch(reg->width) {
+		case 8:
+			return *addr;
+		case 16:
+			return *(volatile uint16_t *) addr;
+		default:
+			return *(volatile uint32_t *) addr;
+	}
+}
+
+static void mmap_write(const struct reg *reg, uint32_t value)
+{
+	volatile uint8_t *addr = windows[reg->window] + reg->offset;
+
+	switch(reg->width) {
+		case 8:
+			*addr = value;
+			break;
+		case 16:
+			*(volatile uint16_t *) addr = value;
+			break;
+		default:
+			*(volatile uint32_t *) addr = value;
+			break;
+	}
+}
+
+static void set_op(struct lophilo_op *op, const struct reg *reg, uint8_t type, uint32_t value)
+{
+	op->offset = reg->offset;
+	op->value = value;
+	op->width = reg->width;
+	op->op = type;
+	op->reserved = 0;
+}
+
+static void write_ops(int fd, struct lophilo_op *ops, int count)
+{
+	ssize_t length = count * sizeof(struct lophilo_op);
+
+	if(pwrite(fd, ops, length, 0) != length)
+		die("batch write");
+}
+
+/* Queue a request on lophilod, draining responses whenever the ring fills */
+static void daemon_submit(int *queued, const struct reg *reg, uint8_t op, uint32_t value)
+{
+	struct lophilod_response resp;
+
+	while(lophilod_submit(&client, reg->window, op, reg->width, reg->offset, value) < 0) {
+		if(lophilod_wait(&client, &resp))
+			die("lophilod");
+		(*queued)--;
+	}
+	(*queued)++;
+}
+
+static void daemon_drain(int queued)
+{
+	struct lophilod_response resp;
+
+	while(queued--)
+		if(lophilod_wait(&client, &resp))
+			die("lophilod");
+}
+
+/* One iteration of a workload through one path */
+static void run_once(enum path path, enum workload workload, int fd, unsigned iteration)
+{
+	struct lophilo_op ops[2 * MAX_PWMS];
+	struct reg reg;
+	static uint8_t dump[WINDOW_SIZE];
+	int i, w, queued = 0;
+
+	switch(workload) {
+		case WL_TOGGLE:
+			if(path == PATH_DEBUGFS)
+				write_text(reg_fd(dout_tgl), 0x1);
+			else if(path == PATH_WINDOW) {
+				set_op(ops, dout, LOPHILO_OP_TGL, 0x1);
+				write_ops(fd, ops, 1);
+			} else if(path == PATH_MMAP)
+				mmap_write(dout, mmap_read(dout) ^ 0x1);
+			else {
+				daemon_submit(&queued, dout, LOPHILO_OP_TGL, 0x1);
+				daemon_drain(queued);
+			}
+			break;
+		case WL_SWEEP:
+			for(i = 0; i < NR_PINS; i++) {
+				if(path == PATH_DEBUGFS)
+					write_text(reg_fd(pins[i]), iteration & 1);
+				else if(path == PATH_WINDOW)
+					set_op(&ops[i], pins[i], LOPHILO_OP_WRITE, iteration & 1);
+				else if(path == PATH_MMAP)
+					mmap_write(pins[i], iteration & 1);
+				else
+					daemon_submit(&queued, pins[i], LOPHILO_OP_WRITE, iteration & 1);
+			}
+			if(path == PATH_WINDOW)
+				write_ops(fd, ops, NR_PINS);
+			daemon_drain(queued);
+			break;
+		case WL_PWM:
+			for(i = 0; i < 2 * nr_pwms; i++) {
+				if(path == PATH_DEBUGFS)
+					write_text(reg_fd(pwms[i / 2][i % 2]), iteration);
+				else if(path == PATH_WINDOW)
+					set_op(&ops[i], pwms[i / 2][i % 2], LOPHILO_OP_WRITE, iteration);
+				else if(path == PATH_MMAP)
+					mmap_write(pwms[i / 2][i % 2], iteration);
+				else
+					daemon_submit(&queued, pwms[i / 2][i % 2], LOPHILO_OP_WRITE, iteration);
+			}
+			if(path == PATH_WINDOW)
+				write_ops(fd, ops, 2 * nr_pwms);
+			daemon_drain(queued);
+			break;
+		case WL_DUMP:
+			if(path == PATH_DEBUGFS) {
+				// every register file the driver created
+				for(i = 0; i < nr_regs; i++)
+					read_text(reg_fd(&regs[i]));
+				break;
+			}
+			for(w = 0; w < 2; w++) {
+				if(path == PATH_WINDOW) {
+					// reads only restart from the top on open
+					fd = open_window(w);
+					if(read(fd, dump, WINDOW_SIZE) < 0)
+						die("read");
+					close(fd);
+					continue;
+				}
+				reg.window = w;
+				reg.width = 32;
+				for(reg.offset = 0; reg.offset < WINDOW_SIZE; reg.offset += 4) {
+					if(path == PATH_MMAP)
+						((uint32_t *) dump)[reg.offset / 4] = mmap_read(&reg);
+					else
+						daemon_submit(&queued, &reg, LOPHILOD_OP_READ, 0);
+				}
+				daemon_drain(queued);
+				queued = 0;
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+static unsigned accesses_of(enum path path, enum workload workload)
+{
+	switch(workload) {
+		case WL_TOGGLE:
+			return 1;
+		case WL_SWEEP:
+			return NR_PINS;
+		case WL_PWM:
+			return 2 * nr_pwms;
+		default:
+			return path == PATH_DEBUGFS ? nr_regs : 2 * WINDOW_SIZE / 4;
+	}
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void add_result(const char *path, const char *workload, unsigned n,
+	double per_sec, unsigned accesses)
+{
+	struct result *r = &results[nr_results++];
+
+	qsort(samples, n, sizeof(*samples), compare_u64);
+	snprintf(r->path, sizeof(r->path), "%s", path);
+	snprintf(r->workload, sizeof(r->workload), "%s", workload);
+	r->iterations = n;
+	r->accesses = accesses;
+	r->per_sec = per_sec;
+	r->p50 = samples[n / 2];
+	r->p99 = samples[(n * 99) / 100 < n ? (n * 99) / 100 : n - 1];
+	r->max = samples[n - 1];
+	fprintf(stderr, "%-9s %-8s %12.0f/s  p50 %8llu ns  p99 %8llu ns\n",
+		r->path, r->workload, r->per_sec,
+		(unsigned long long) r->p50, (unsigned long long) r->p99);
+}
+
+static void run_path(enum path path, unsigned n)
+{
+	uint64_t start, end, total;
+	int fd = -1, w;
+	unsigned i;
+
+	if(path == PATH_MMAP)
+		map_windows();
+
+	for(w = 0; w < NR_WORKLOADS; w++) {
+		if(w == WL_PWM && !nr_pwms)
+			continue;
+		// the dump opens the windows itself and each allows one opener
+		if(path == PATH_WINDOW && w != WL_DUMP)
+			fd = open_window(LOPHILO_WINDOW_MOD);
+		run_once(path, w, fd, 0);		// warm up: open files, fault pages
+		total = 0;
+		for(i = 0; i < n; i++) {
+			start = now_ns();
+			run_once(path, w, fd, i);
+			end = now_ns();
+			samples[i] = end - start;
+			total += end - start;
+		}
+		add_result(path_names[path], workload_names[w], n,
+			total ? n * 1e9 / total : 0, accesses_of(path, w));
+		if(fd >= 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	if(path == PATH_MMAP)
+		unmap_windows();
+	close_reg_fds();
+}
+
+static int download_done(int fd)
+{
+	char status[128];
+	ssize_t len = pread(fd, status, sizeof(status) - 1, 0);
+
+	if(len < 0)
+		die("status");
+	status[len] = 0;
+	if(strstr(status, "state=running"))
+		return 0;
+	if(!strstr(status, "state=done")) {
+		fprintf(stderr, "lophilo_bench: download failed: %s", status);
+		exit(2);
+	}
+	return 1;
+}
+
+/* Time data + download + status polling; per_sec is in bytes */
+static void run_download(const char *bitstream, int simulate)
+{
+	static uint8_t image[500 * 1024];
+	uint64_t start, total = 0;
+	ssize_t size = STANDIN_IMAGE, chunk;
+	int fd, data, status, i;
+
+	if(!simulate) {
+		fd = open(bitstream, O_RDONLY);
+		if(fd < 0)
+			die(bitstream);
+		size = read(fd, image, sizeof(image));
+		close(fd);
+		if(size <= 0)
+			die(bitstream);
+	}
+
+	for(i = 0; i < DOWNLOAD_REPS; i++) {
+		start = now_ns();
+		data = open_in(fpga_dir, NULL, "data", O_WRONLY);
+		if(data < 0)
+			die("fpga data");
+		for(chunk = 0; chunk < size; chunk += 4096)
+			if(write(data, image + chunk, size - chunk < 4096 ? size - chunk : 4096) < 0)
+				die("fpga data");
+		close(data);
+		fd = open_in(fpga_dir, NULL, "download", O_WRONLY);
+		if(fd < 0 || write(fd, "1", 1) != 1)
+			die("fpga download");
+		close(fd);
+		status = open_in(fpga_dir, NULL, "status", O_RDONLY);
+		if(status < 0)
+			die("fpga status");
+		while(!download_done(status))
+			usleep(1000);
+		close(status);
+		samples[i] = now_ns() - start;
+		total += samples[i];
+	}
+	add_result("fpga", "download", DOWNLOAD_REPS,
+		total ? (double) size * DOWNLOAD_REPS * 1e9 / total : 0, 0);
+}
+
+static void write_report(FILE *out, int simulate)
+{
+	int i;
+
+	fprintf(out, "{\"standin\": %s, \"results\": [\n", simulate ? "true" : "false");
+	for(i = 0; i < nr_results; i++)
+		fprintf(out, "{\"path\": \"%s\", \"workload\": \"%s\", \"iterations\": %u, "
+			"\"accesses\": %u, \"per_sec\": %.1f, \"p50_ns\": %llu, "
+			"\"p99_ns\": %llu, \"max_ns\": %llu}%s\n",
+			results[i].path, results[i].workload, results[i].iterations,
+			results[i].accesses, results[i].per_sec,
+			(unsigned long long) results[i].p50,
+			(unsigned long long) results[i].p99,
+			(unsigned long long) results[i].max,
+			i + 1 < nr_results ? "," : "");
+	fprintf(out, "]}\n");
+}
+
+/* Report every median that grew by more than tolerance percent */
+static int compare_baseline(const char *baseline, double tolerance)
+{
+	char line[512], path[16], workload[16];
+	unsigned long long p50;
+	int i, regressed = 0;
+	FILE *in;
+
+	in = fopen(baseline, "r");
+	if(!in)
+		die(baseline);
+	while(fgets(line, sizeof(line), in)) {
+		if(sscanf(line, "{\"path\": \"%15[^\"]\", \"workload\": \"%15[^\"]\", "
+			  "\"iterations\": %*u, \"accesses\": %*u, \"per_sec\": %*f, "
+			  "\"p50_ns\": %llu", path, workload, &p50) != 3)
+			continue;
+		for(i = 0; i < nr_results; i++) {
+			if(strcmp(results[i].path, path) || strcmp(results[i].workload, workload))
+				continue;
+			if(results[i].p50 > p50 * (1 + tolerance / 100)) {
+				fprintf(stderr, "lophilo_bench: %s %s regressed: p50 %llu ns, baseline %llu ns\n",
+					path, workload, (unsigned long long) results[i].p50, p50);
+				regressed = 1;
+			}
+		}
+	}
+	fclose(in);
+	return regressed;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: lophilo_bench [-s] [-n iterations] [-d lophilo dir] [-F fpga dir] "
+		"[-f bitstream] [-o report.json] [-c baseline.json] [-t tolerance %%]\n");
+	exit(2);
+}
+
+int main(int argc, char* argv[])
+{
+	const char *bitstream = NULL, *report = NULL, *baseline = NULL;
+	double tolerance = 20;
+	unsigned n = 1000;
+	int simulate = 0, regressed = 0, opt, path;
+	FILE *out = stdout;
+
+	while((opt = getopt(argc, argv, "sn:d:F:f:o:c:t:")) != -1) {
+		switch(opt) {
+			case 's':
+				simulate = 1;
+				break;
+			case 'n':
+				n = strtoul(optarg, NULL, 0);
+				break;
+			case 'd':
+				snprintf(lophilo_dir, sizeof(lophilo_dir), "%s", optarg);
+				break;
+			case 'F':
+				snprintf(fpga_dir, sizeof(fpga_dir), "%s", optarg);
+				break;
+			case 'f':
+				bitstream = optarg;
+				break;
+			case 'o':
+				report = optarg;
+				break;
+			case 'c':
+				baseline = optarg;
+				break;
+			case 't':
+				tolerance = strtod(optarg, NULL);
+				break;
+			default:
+				usage();
+		}
+	}
+	if(!n)
+		usage();
+
+	samples = calloc(n > DOWNLOAD_REPS ? n : DOWNLOAD_REPS, sizeof(*samples));
+	if(!samples)
+		die("calloc");
+	if(simulate)
+		make_standin();
+	load_registry();
+
+	for(path = 0; path < NR_PATHS; path++) {
+		if(path == PATH_LOPHILOD) {
+			/*
+			 * Only when a daemon is running, and never for the stand-in:
+			 * its made-up offsets must not reach a real daemon's registers.
+			 */
+			if(simulate || lophilod_attach(&client, 0))
+				continue;
+			run_path(path, n);
+			lophilod_detach(&client);
+			continue;
+		}
+		run_path(path, n);
+	}
+	// last: a download resets every register
+	if(simulate || bitstream)
+		run_download(bitstream, simulate);
+
+	if(simulate)
+		remove_standin();
+
+	if(report) {
+		out = fopen(report, "w");
+		if(!out)
+			die(report);
+	}
+	write_report(out, simulate);
+	if(report)
+		fclose(out);
+	if(baseline)
+		regressed = compare_baseline(baseline, tolerance);
+	return regressed;
+}
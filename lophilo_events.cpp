@@ -0,0 +1,283 @@
+/*
+ * Coroutine event API for the Lophilo EINT and GPIO debugfs files
+ *
+ * Copyright 2012 Lophilo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+#include "lophilo_events.hpp"
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <system_error>
+
+namespace lophilo {
+
+namespace {
+
+[[noreturn]] void throw_errno(const std::string& what)
+{
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+// Root frame of a spawned task; it stays listed in the reactor until it ends
+struct Detached {
+	struct promise_type {
+		std::set<std::coroutine_handle<>>* spawned = nullptr;
+
+		Detached get_return_object() { return {handle::from_promise(*this)}; }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept
+		{
+			spawned->erase(handle::from_promise(*this));
+			return {};
+		}
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+	using handle = std::coroutine_handle<promise_type>;
+
+	handle h;
+};
+
+Detached run_detached(Task<> task)
+{
+	co_await std::move(task);
+}
+
+} // namespace
+
+Reactor::Reactor()
+{
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	if(epoll_fd_ < 0)
+		throw_errno("epoll_create1");
+}
+
+// Destroying a root frame destroys the tasks it awaits, down to the awaiter
+Reactor::~Reactor()
+{
+	while(!spawned_.empty()) {
+		auto h = *spawned_.begin();
+		spawned_.erase(spawned_.begin());
+		h.destroy();
+	}
+	close(epoll_fd_);
+}
+
+void Reactor::spawn(Task<> task)
+{
+	auto h = run_detached(std::move(task)).h;
+
+	h.promise().spawned = &spawned_;
+	spawned_.insert(h);
+	h.resume();
+}
+
+// EPOLLONESHOT: a descriptor is only reported while someone waits on it
+void Reactor::arm(int fd, bool add)
+{
+	struct epoll_event ev = {};
+
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.fd = fd;
+	if(epoll_ctl(epoll_fd_, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev) < 0)
+		throw_errno("epoll_ctl");
+}
+
+void Reactor::wait_readable(int fd, std::coroutine_handle<> h)
+{
+	auto it = waiters_.find(fd);
+	bool add = it == waiters_.end();
+
+	if(add || it->second.empty())
+		arm(fd, add);
+	waiters_[fd].push_back(h);
+}
+
+void Reactor::forget(int fd)
+{
+	if(waiters_.erase(fd))
+		epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+void Reactor::run()
+{
+	struct epoll_event events[16];
+	std::vector<std::coroutine_handle<>> ready;
+	int i, n;
+
+	stopped_ = false;
+	while(!stopped_) {
+		bool waiting = false;
+		for(auto& w : waiters_)
+			waiting |= !w.second.empty();
+		if(!waiting)
+			break;
+
+		n = epoll_wait(epoll_fd_, events, 16, -1);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			throw_errno("epoll_wait");
+		}
+		for(i = 0; i < n; i++) {
+			auto it = waiters_.find(events[i].data.fd);
+			if(it == waiters_.end())
+				continue;
+			ready.swap(it->second);
+			for(auto h : ready)
+				h.resume();
+			ready.clear();
+		}
+	}
+}
+
+Reactor::SleepAwaiter Reactor::sleep(std::chrono::nanoseconds duration)
+{
+	return SleepAwaiter(*this, duration);
+}
+
+Reactor::SleepAwaiter::SleepAwaiter(Reactor& reactor, std::chrono::nanoseconds duration)
+	: reactor_(reactor)
+{
+	struct itimerspec spec = {};
+	auto ns = duration.count() > 0 ? duration.count() : 1;
+
+	fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(fd_ < 0)
+		throw_errno("timerfd_create");
+	spec.it_value.tv_sec = ns / 1000000000;
+	spec.it_value.tv_nsec = ns % 1000000000;
+	if(timerfd_settime(fd_, 0, &spec, nullptr) < 0) {
+		close(fd_);
+		throw_errno("timerfd_settime");
+	}
+}
+
+Reactor::SleepAwaiter::~SleepAwaiter()
+{
+	reactor_.forget(fd_);
+	close(fd_);
+}
+
+void Reactor::SleepAwaiter::await_suspend(std::coroutine_handle<> h)
+{
+	reactor_.wait_readable(fd_, h);
+}
+
+void Reactor::SleepAwaiter::await_resume()
+{
+	uint64_t expirations;
+
+	if(read(fd_, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		throw_errno("timerfd read");
+}
+
+EintLine::EintLine(Reactor& reactor, const std::string& path)
+	: reactor_(reactor), path_(path)
+{
+	fd_ = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if(fd_ < 0)
+		throw_errno(path);
+}
+
+EintLine::~EintLine()
+{
+	reactor_.forget(fd_);
+	close(fd_);
+}
+
+std::optional<uint32_t> EintLine::try_read()
+{
+	char buf[16];
+	ssize_t n;
+
+	n = read(fd_, buf, sizeof(buf) - 1);
+	if(n < 0) {
+		if(errno == EAGAIN)
+			return std::nullopt;
+		throw_errno(path_);
+	}
+	// EINT files never return EOF; anything that does would stay readable
+	if(n == 0)
+		throw std::system_error(ENODATA, std::generic_category(), path_);
+	buf[n] = '\0';
+	count_ = static_cast<uint32_t>(strtoul(buf, nullptr, 10));
+	return count_;
+}
+
+bool EintLine::EdgeAwaiter::await_ready()
+{
+	count_ = line_.try_read();
+	return count_.has_value();
+}
+
+void EintLine::EdgeAwaiter::await_suspend(std::coroutine_handle<> h)
+{
+	line_.reactor_.wait_readable(line_.fd_, h);
+}
+
+uint32_t EintLine::EdgeAwaiter::await_resume()
+{
+	// several coroutines woken by the same edge share one read; the ones
+	// that find nothing left report the count the first one consumed
+	if(!count_)
+		count_ = line_.try_read();
+	return count_.value_or(line_.count_);
+}
+
+GpioWatch::GpioWatch(Reactor& reactor, const std::string& din_path, uint32_t mask,
+		EintLine* source, std::chrono::nanoseconds interval)
+	: reactor_(reactor), path_(din_path), mask_(mask), source_(source),
+	  interval_(interval)
+{
+	fd_ = open(din_path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd_ < 0)
+		throw_errno(din_path);
+	last_ = read();
+}
+
+GpioWatch::~GpioWatch()
+{
+	close(fd_);
+}
+
+// debugfs x32 files hold "0x%08x\n"; pread restarts at the register
+uint32_t GpioWatch::read()
+{
+	char buf[16];
+	ssize_t n;
+
+	n = pread(fd_, buf, sizeof(buf) - 1, 0);
+	if(n < 0)
+		throw_errno(path_);
+	buf[n] = '\0';
+	return static_cast<uint32_t>(strtoul(buf, nullptr, 0)) & mask_;
+}
+
+Task<uint32_t> GpioWatch::changed()
+{
+	uint32_t now;
+
+	for(;;) {
+		if(source_)
+			co_await source_->next_edge();
+		else
+			co_await reactor_.sleep(interval_);
+		now = read();
+		if(now != last_) {
+			last_ = now;
+			co_return now;
+		}
+	}
+}
+
+} // namespace lophilo
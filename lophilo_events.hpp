@@ -0,0 +1,268 @@
+/*
+ * Coroutine event API for the Lophilo EINT and GPIO debugfs files
+ *
+ * Copyright 2012 Lophilo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * One Reactor (an epoll loop) drives any number of coroutines on a single
+ * thread:
+ *
+ *	lophilo::Reactor reactor;	// declared before anything using it
+ *	lophilo::EintLine eint3(reactor, "/sys/kernel/debug/lophilo/EINT3");
+ *
+ *	lophilo::Task<> count_edges(lophilo::EintLine& line) {
+ *		for(;;) {
+ *			uint32_t count = co_await line.next_edge();
+ *			...
+ *		}
+ *	}
+ *
+ *	reactor.spawn(count_edges(eint3));
+ *	reactor.run();
+ */
+#ifndef LOPHILO_EVENTS_HPP
+#define LOPHILO_EVENTS_HPP
+
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace lophilo {
+
+template<typename T = void> class Task;
+
+namespace detail {
+
+// Resumes whoever co_awaited the task once it finishes
+template<typename Promise>
+struct FinalAwaiter {
+	bool await_ready() noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept
+	{
+		if(h.promise().continuation)
+			return h.promise().continuation;
+		return std::noop_coroutine();
+	}
+	void await_resume() noexcept {}
+};
+
+struct PromiseBase {
+	std::coroutine_handle<> continuation;
+	std::exception_ptr exception;
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	void unhandled_exception() { exception = std::current_exception(); }
+};
+
+} // namespace detail
+
+/*
+ * Lazily started coroutine. It runs when co_awaited (or passed to spawn)
+ * and hands its result, or exception, back to the awaiting coroutine.
+ */
+template<typename T>
+class Task {
+public:
+	struct promise_type : detail::PromiseBase {
+		std::optional<T> value;
+
+		Task get_return_object() { return Task(handle::from_promise(*this)); }
+		detail::FinalAwaiter<promise_type> final_suspend() noexcept { return {}; }
+		void return_value(T v) { value = std::move(v); }
+	};
+	using handle = std::coroutine_handle<promise_type>;
+
+	Task(Task&& other) noexcept : h_(std::exchange(other.h_, {})) {}
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+	~Task() { if(h_) h_.destroy(); }
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+	{
+		h_.promise().continuation = awaiting;
+		return h_;
+	}
+	T await_resume()
+	{
+		if(h_.promise().exception)
+			std::rethrow_exception(h_.promise().exception);
+		return std::move(*h_.promise().value);
+	}
+
+private:
+	explicit Task(handle h) : h_(h) {}
+	handle h_;
+};
+
+template<>
+class Task<void> {
+public:
+	struct promise_type : detail::PromiseBase {
+		Task get_return_object() { return Task(handle::from_promise(*this)); }
+		detail::FinalAwaiter<promise_type> final_suspend() noexcept { return {}; }
+		void return_void() {}
+	};
+	using handle = std::coroutine_handle<promise_type>;
+
+	Task(Task&& other) noexcept : h_(std::exchange(other.h_, {})) {}
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+	~Task() { if(h_) h_.destroy(); }
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+	{
+		h_.promise().continuation = awaiting;
+		return h_;
+	}
+	void await_resume()
+	{
+		if(h_.promise().exception)
+			std::rethrow_exception(h_.promise().exception);
+	}
+
+private:
+	explicit Task(handle h) : h_(h) {}
+	handle h_;
+};
+
+/*
+ * Single-threaded epoll loop. Awaiters park their coroutine on a file
+ * descriptor and the reactor resumes it once the descriptor is readable.
+ * EintLine, GpioWatch and sleeps unregister from the reactor when they go
+ * away, so it has to outlive them.
+ */
+class Reactor {
+public:
+	Reactor();
+	~Reactor();
+	Reactor(const Reactor&) = delete;
+	Reactor& operator=(const Reactor&) = delete;
+
+	// Dispatch events until stop() is called or nothing is waiting
+	void run();
+	void stop() { stopped_ = true; }
+
+	/*
+	 * Start a task without awaiting it. The frame frees itself when the
+	 * task completes, or with the reactor if it is still suspended then;
+	 * an exception escaping it terminates the program.
+	 */
+	void spawn(Task<> task);
+
+	// Resume h the next time fd becomes readable
+	void wait_readable(int fd, std::coroutine_handle<> h);
+	void forget(int fd);
+
+	class SleepAwaiter;
+	SleepAwaiter sleep(std::chrono::nanoseconds duration);
+
+private:
+	void arm(int fd, bool add);
+
+	int epoll_fd_;
+	bool stopped_ = false;
+	std::map<int, std::vector<std::coroutine_handle<>>> waiters_;
+	std::set<std::coroutine_handle<>> spawned_;
+};
+
+class Reactor::SleepAwaiter {
+public:
+	SleepAwaiter(Reactor& reactor, std::chrono::nanoseconds duration);
+	~SleepAwaiter();
+	SleepAwaiter(const SleepAwaiter&) = delete;
+	SleepAwaiter& operator=(const SleepAwaiter&) = delete;
+
+	bool await_ready() const noexcept { return false; }
+	void await_suspend(std::coroutine_handle<> h);
+	void await_resume();
+
+private:
+	Reactor& reactor_;
+	int fd_;
+};
+
+/*
+ * One lophilo/EINTn file. Reads return the line's running edge count and
+ * only succeed once the count moved since the previous read, so a burst
+ * of edges that arrives while the coroutine is busy is reported once,
+ * with a count that tells how many edges it covered.
+ */
+class EintLine {
+public:
+	EintLine(Reactor& reactor, const std::string& path);
+	~EintLine();
+	EintLine(const EintLine&) = delete;
+	EintLine& operator=(const EintLine&) = delete;
+
+	class EdgeAwaiter {
+	public:
+		explicit EdgeAwaiter(EintLine& line) : line_(line) {}
+		bool await_ready();
+		void await_suspend(std::coroutine_handle<> h);
+		uint32_t await_resume();
+
+	private:
+		EintLine& line_;
+		std::optional<uint32_t> count_;
+	};
+
+	// Completes with the edge count once the line has seen a new edge
+	EdgeAwaiter next_edge() { return EdgeAwaiter(*this); }
+
+	const std::string& path() const { return path_; }
+
+private:
+	std::optional<uint32_t> try_read();
+
+	Reactor& reactor_;
+	std::string path_;
+	int fd_;
+	uint32_t count_ = 0;
+};
+
+/*
+ * Watches a mask of pins in a gpioN/din file. The register is re-read
+ * after each edge on the EINT line the GPIO block interrupts through or,
+ * without one, every interval.
+ */
+class GpioWatch {
+public:
+	GpioWatch(Reactor& reactor, const std::string& din_path, uint32_t mask,
+		EintLine* source,
+		std::chrono::nanoseconds interval = std::chrono::milliseconds(10));
+	~GpioWatch();
+	GpioWatch(const GpioWatch&) = delete;
+	GpioWatch& operator=(const GpioWatch&) = delete;
+
+	// Completes with the masked pin value once it differs from the last one
+	Task<uint32_t> changed();
+
+	uint32_t read();
+	uint32_t last() const { return last_; }
+
+private:
+	Reactor& reactor_;
+	std::string path_;
+	uint32_t mask_;
+	EintLine* source_;
+	std::chrono::nanoseconds interval_;
+	int fd_;
+	uint32_t last_;
+};
+
+} // namespace lophilo
+
+#endif /* LOPHILO_EVENTS_HPP */
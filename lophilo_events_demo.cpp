@@ -0,0 +1,69 @@
+/*
+ * Print every EINT edge and every gpio0 pin change from a single thread
+ *
+ * Usage: lophilo_events_demo [debugfs dir] [gpio0 EINT line]
+ *
+ * Copyright 2012 Lophilo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+#include "lophilo_events.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <system_error>
+
+#define EINT_LINES 8
+
+static lophilo::Task<> print_edges(lophilo::EintLine& line)
+{
+	try {
+		for(;;) {
+			uint32_t count = co_await line.next_edge();
+			printf("%s: %u edges\n", line.path().c_str(), count);
+		}
+	} catch(const std::system_error& e) {
+		fprintf(stderr, "%s\n", e.what());
+	}
+}
+
+static lophilo::Task<> print_pins(lophilo::GpioWatch& watch)
+{
+	for(;;) {
+		uint32_t pins = co_await watch.changed();
+		printf("gpio0/din: 0x%08x\n", pins);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	std::string dir = argc > 1 ? argv[1] : "/sys/kernel/debug/lophilo";
+	int gpio_eint = argc > 2 ? atoi(argv[2]) : -1;
+	// the lines and the watch unregister from the reactor, so it goes last
+	lophilo::Reactor reactor;
+	std::unique_ptr<lophilo::EintLine> lines[EINT_LINES];
+	int i;
+
+	try {
+		for(i = 0; i < EINT_LINES; i++) {
+			lines[i] = std::make_unique<lophilo::EintLine>(
+				reactor, dir + "/EINT" + std::to_string(i));
+			reactor.spawn(print_edges(*lines[i]));
+		}
+
+		// the gpio watch shares its EINT line with print_edges above
+		lophilo::GpioWatch pins(reactor, dir + "/gpio0/din", 0x03ffffff,
+			gpio_eint >= 0 && gpio_eint < EINT_LINES ? lines[gpio_eint].get() : nullptr);
+		reactor.spawn(print_pins(pins));
+
+		reactor.run();
+	} catch(const std::system_error& e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
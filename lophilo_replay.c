@@ -0,0 +1,215 @@
+/*
+ * lophilo_replay: feed a register write trace (lophilo/trace/data) back
+ * through the sysmem/modmem batch path
+ *
+ * Usage: lophilo_replay [-x speed] [-d debugfs dir] [-p pid] trace.bin
+ *
+ *	-x	timing: 1 replays at the recorded pace (default), 10 ten times
+ *		faster, 0 as fast as possible
+ *	-d	where the lophilo directories are (/sys/kernel/debug)
+ *	-p	only replay the writes of this process
+ *
+ *	cat /sys/kernel/debug/lophilo/trace/data > trace.bin
+ *	lophilo_replay -x 0 trace.bin
+ *
+ * Writes are replayed in timestamp order with their recorded value as a
+ * plain write, so a set/clear/toggle lands on the value it produced when
+ * it was traced. Writes that are due together and target the same window
+ * go out as one batch.
+ *
+ * Copyright 2012 Lophilo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lophilo.h"
+
+#define MAX_BOARDS	2
+#define MAX_BATCH	256
+
+static const char *window_names[] = { "sysmem", "modmem" };
+static char debugfs_dir[PATH_MAX] = "/sys/kernel/debug";
+static int window_fds[MAX_BOARDS][2];
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline)
+{
+	struct timespec ts;
+
+	ts.tv_sec = deadline / 1000000000ull;
+	ts.tv_nsec = deadline % 1000000000ull;
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/* A record and its position in the capture, the tie-breaker for sorting */
+struct entry {
+	struct lophilo_trace_record record;
+	long index;
+};
+
+/* Sort by timestamp, keeping the capture order of equal ones (one CPU's ring) */
+static int compare_entries(const void *a, const void *b)
+{
+	const struct entry *x = a, *y = b;
+
+	if(x->record.timestamp != y->record.timestamp)
+		return x->record.timestamp < y->record.timestamp ? -1 : 1;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static int window_fd(uint8_t board, uint8_t window)
+{
+	char path[PATH_MAX];
+
+	if(!window_fds[board][window]) {
+		// the first board keeps the unnumbered directory name
+		if(board)
+			snprintf(path, sizeof(path), "%s/lophilo%u/%s", debugfs_dir, board, window_names[window]);
+		else
+			snprintf(path, sizeof(path), "%s/lophilo/%s", debugfs_dir, window_names[window]);
+		window_fds[board][window] = open(path, O_WRONLY);
+		if(window_fds[board][window] < 0) {
+			perror(path);
+			exit(1);
+		}
+	}
+	return window_fds[board][window];
+}
+
+static void flush(const struct lophilo_trace_record *first, struct lophilo_op *ops, int count)
+{
+	ssize_t length = count * sizeof(struct lophilo_op);
+	ssize_t ret;
+
+	if(!count)
+		return;
+	ret = write(window_fd(first->board, first->window), ops, length);
+	if(ret != length) {
+		fprintf(stderr, "lophilo_replay: batch of %d writes to %s at offset 0x%x failed: %s\n",
+			count, window_names[first->window], ops[ret > 0 ? ret / sizeof(*ops) : 0].offset,
+			ret < 0 ? strerror(errno) : "rejected");
+		exit(1);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	struct lophilo_trace_record *record, *first = NULL;
+	struct entry *entries;
+	struct lophilo_op ops[MAX_BATCH];
+	uint64_t start, due, late, max_late = 0, elapsed;
+	double speed = 1;
+	long size, n, i;
+	int opt, count = 0, batches = 0, replayed = 0, pid = -1;
+	FILE *in;
+
+	while((opt = getopt(argc, argv, "x:d:p:")) != -1) {
+		switch(opt) {
+			case 'x':
+				speed = strtod(optarg, NULL);
+				break;
+			case 'd':
+				snprintf(debugfs_dir, sizeof(debugfs_dir), "%s", optarg);
+				break;
+			case 'p':
+				pid = atoi(optarg);
+				break;
+			default:
+				optind = argc;
+				break;
+		}
+	}
+	if(optind != argc - 1 || speed < 0) {
+		fprintf(stderr, "Usage: lophilo_replay [-x speed] [-d debugfs dir] [-p pid] trace.bin\n");
+		return 1;
+	}
+
+	in = fopen(argv[optind], "rb");
+	if(!in) {
+		perror(argv[optind]);
+		return 1;
+	}
+	fseek(in, 0, SEEK_END);
+	size = ftell(in);
+	rewind(in);
+	n = size / sizeof(struct lophilo_trace_record);
+	entries = malloc(n ? n * sizeof(*entries) : 1);
+	if(!entries) {
+		perror("malloc");
+		return 1;
+	}
+	for(i = 0; i < n; i++) {
+		if(fread(&entries[i].record, sizeof(entries[i].record), 1, in) != 1) {
+			fprintf(stderr, "lophilo_replay: cannot read %s\n", argv[optind]);
+			return 1;
+		}
+		entries[i].index = i;
+	}
+	fclose(in);
+	qsort(entries, n, sizeof(*entries), compare_entries);
+
+	start = now_ns();
+	for(i = 0; i < n; i++) {
+		record = &entries[i].record;
+		if(record->board >= MAX_BOARDS || record->window > LOPHILO_WINDOW_MOD ||
+		   (pid >= 0 && record->pid != pid))
+			continue;
+
+		due = start;
+		if(speed > 0)
+			due += (record->timestamp - entries[0].record.timestamp) / speed;
+		// a batch only holds writes that are due together on one window
+		if(count && (count == MAX_BATCH || record->board != first->board ||
+			     record->window != first->window || due > now_ns())) {
+			flush(first, ops, count);
+			batches++;
+			count = 0;
+		}
+		if(due > now_ns())
+			sleep_until(due);
+		late = now_ns() - due;
+		if(late > max_late)
+			max_late = late;
+
+		if(!count)
+			first = record;
+		ops[count].offset = record->offset;
+		ops[count].value = record->value;
+		ops[count].width = record->width;
+		ops[count].op = LOPHILO_OP_WRITE;
+		ops[count].reserved = 0;
+		count++;
+		replayed++;
+	}
+	if(count) {
+		flush(first, ops, count);
+		batches++;
+	}
+	elapsed = now_ns() - start;
+
+	fprintf(stderr, "lophilo_replay: %d writes in %d batches, %.3f s, %.0f writes/s, max %llu us late\n",
+		replayed, batches, elapsed / 1e9, elapsed ? replayed * 1e9 / elapsed : 0,
+		(unsigned long long) (speed > 0 ? max_late / 1000 : 0));
+	free(entries);
+	return 0;
+}
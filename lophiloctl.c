@@ -0,0 +1,136 @@
+/*
+ * lophiloctl: apply register operations through lophilod
+ *
+ * Usage: lophiloctl [-p priority] <op> <sys|mod> <offset> [value] ...
+ *
+ * op is read, write, set, clr or tgl, optionally followed by the width
+ * (write8, set16, ...; 32 when omitted). All operations on the command
+ * line are handed to lophilod at once, so it applies them as one batch:
+ *
+ *	lophiloctl write sys 0x200 0x03030300 set mod 0x10 0xffffffff
+ *
+ * Copyright 2012 Lophilo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lophilod.h"
+
+static const char *op_names[] = { "write", "set", "clr", "tgl" };
+
+static int parse_op(const char *name, uint8_t *op, uint8_t *width)
+{
+	const char *suffix;
+	size_t i, len;
+
+	if(!strncmp(name, "read", 4)) {
+		*op = LOPHILOD_OP_READ;
+		suffix = name + 4;
+	} else {
+		for(i = 0; i < sizeof(op_names) / sizeof(op_names[0]); i++) {
+			len = strlen(op_names[i]);
+			if(!strncmp(name, op_names[i], len))
+				break;
+		}
+		if(i == sizeof(op_names) / sizeof(op_names[0]))
+			return -1;
+		*op = i;
+		suffix = name + len;
+	}
+	*width = *suffix ? atoi(suffix) : 32;
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: lophiloctl [-p priority] <read|write|set|clr|tgl>[8|16|32] <sys|mod> <offset> [value] ...\n");
+}
+
+int main(int argc, char* argv[])
+{
+	struct lophilod_client client;
+	struct lophilod_response resp;
+	uint32_t priority = 0;
+	uint8_t op, width, window;
+	uint32_t offset, value;
+	int i = 1, queued = 0, ret, failed = 0;
+
+	if(argc > 2 && !strcmp(argv[1], "-p")) {
+		priority = strtoul(argv[2], NULL, 0);
+		i = 3;
+	}
+	if(i >= argc) {
+		usage();
+		return 1;
+	}
+
+	ret = lophilod_attach(&client, priority);
+	if(ret) {
+		fprintf(stderr, "lophiloctl: cannot attach to lophilod: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	while(i < argc) {
+		if(argc - i < 3 || parse_op(argv[i], &op, &width)) {
+			usage();
+			failed = 1;
+			break;
+		}
+		if(!strcmp(argv[i + 1], "sys"))
+			window = LOPHILO_WINDOW_SYS;
+		else if(!strcmp(argv[i + 1], "mod"))
+			window = LOPHILO_WINDOW_MOD;
+		else {
+			fprintf(stderr, "lophiloctl: unknown window %s\n", argv[i + 1]);
+			failed = 1;
+			break;
+		}
+		offset = strtoul(argv[i + 2], NULL, 0);
+		i += 3;
+		value = 0;
+		if(op != LOPHILOD_OP_READ) {
+			if(i >= argc) {
+				usage();
+				failed = 1;
+				break;
+			}
+			value = strtoul(argv[i++], NULL, 0);
+		}
+		if(lophilod_queue(&client, window, op, width, offset, value) < 0) {
+			fprintf(stderr, "lophiloctl: too many operations\n");
+			failed = 1;
+			break;
+		}
+		queued++;
+	}
+	// a bad command line applies nothing: what was staged is never published
+	if(failed)
+		queued = 0;
+	else
+		lophilod_flush(&client);
+
+	while(queued--) {
+		ret = lophilod_wait(&client, &resp);
+		if(ret) {
+			fprintf(stderr, "lophiloctl: %s\n", strerror(-ret));
+			failed = 1;
+			break;
+		}
+		if(resp.status < 0) {
+			fprintf(stderr, "lophiloctl: operation %u: %s\n", resp.seq, strerror(-resp.status));
+			failed = 1;
+		} else if(resp.status == LOPHILOD_SUPERSEDED) {
+			fprintf(stderr, "lophiloctl: operation %u superseded by a higher-priority client\n", resp.seq);
+			failed = 1;
+		}
+		printf("0x%08x\n", resp.value);
+	}
+
+	lophilod_detach(&client);
+	return failed;
+}
@@ -0,0 +1,438 @@
+/*
+ * lophilod: owns the Lophilo sysmem/modmem mappings and serves register
+ * operations to client processes over shared-memory rings (lophilod.h).
+ *
+ * Usage: lophilod [-s] [-t trace.bin] [debugfs dir]
+ *	-s	serve an in-memory register file instead of the hardware
+ *	-t	append a struct lophilo_trace_record for every bus write; the
+ *		driver can't see writes through the mapping, so lophilo/trace
+ *		misses them
+ *
+ * Copyright 2012 Lophilo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Every pass drains the pending requests of all clients into one batch.
+ * Requests are applied in order, but consecutive operations on the same
+ * register are folded through a one-entry cache: a run of set/clear/
+ * toggle/read requests costs at most one bus read and one bus write.
+ * Within a batch, a full write from a client is superseded if a client of
+ * higher priority already wrote the same register.
+ */
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "lophilod.h"
+
+#define WINDOW_SIZE	4096		/* what map_lophilo hands out */
+#define MAX_BATCH	(LOPHILOD_MAX_CLIENTS * LOPHILOD_RING_SIZE)
+#define WRITERS_SIZE	1024		/* power of two, > MAX_BATCH */
+#define REAP_INTERVAL_MS 1000
+
+struct pending {
+	struct lophilod_slot *slot;
+	struct lophilod_request req;
+	struct lophilod_response resp;
+};
+
+/* who wrote a register last in the current batch */
+struct writer {
+	uint32_t key;			/* 0 when unused */
+	uint32_t priority;
+	struct lophilod_slot *slot;
+};
+
+static volatile uint8_t *windows[2];
+static struct lophilod_shm *shm;
+static struct pending batch[MAX_BATCH];
+static struct writer writers[WRITERS_SIZE];
+static volatile sig_atomic_t stopped;
+static FILE *trace;
+static uint8_t trace_board;
+
+static unsigned long long stat_requests, stat_batches, stat_reads, stat_writes;
+
+static void stop(int sig)
+{
+	stopped = 1;
+}
+
+static uint32_t reg_read(uint8_t window, uint32_t offset, uint8_t width)
+{
+	volatile uint8_t *addr = windows[window] + offset;
+
+	stat_reads++;
+	switch(width) {
+		case 8:
+			return *addr;
+		case 16:
+			return *(volatile uint16_t *) addr;
+		default:
+			return *(volatile uint32_t *) addr;
+	}
+}
+
+static void reg_write(uint8_t window, uint32_t offset, uint8_t width, uint32_t value)
+{
+	volatile uint8_t *addr = windows[window] + offset;
+
+	stat_writes++;
+	switch(width) {
+		case 8:
+			*addr = value;
+			break;
+		case 16:
+			*(volatile uint16_t *) addr = value;
+			break;
+		default:
+			*(volatile uint32_t *) addr = value;
+			break;
+	}
+}
+
+/* Bus write of the value p's request left in its register */
+static void flush_reg(const struct pending *p, uint32_t value)
+{
+	struct lophilo_trace_record record;
+	struct timespec ts;
+
+	reg_write(p->req.window, p->req.offset, p->req.width, value);
+	if(!trace)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	record.timestamp = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	record.offset = p->req.offset;
+	record.value = value;
+	record.pid = p->slot->owner;
+	record.board = trace_board;
+	record.window = p->req.window;
+	record.width = p->req.width;
+	record.op = p->req.op;
+	fwrite(&record, sizeof(record), 1, trace);
+}
+
+static int map_window(const char *dir, const char *name, int simulate, volatile uint8_t **window)
+{
+	char path[PATH_MAX];
+	void *data;
+	int fd;
+
+	if(simulate) {
+		data = mmap(NULL, WINDOW_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	} else {
+		snprintf(path, sizeof(path), "%s/%s", dir, name);
+		fd = open(path, O_RDWR);
+		if(fd < 0) {
+			perror(path);
+			return -1;
+		}
+		data = mmap(NULL, WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+	}
+	if(data == MAP_FAILED) {
+		perror(name);
+		return -1;
+	}
+	*window = data;
+	return 0;
+}
+
+static int create_shm(void)
+{
+	int fd;
+
+	shm_unlink(LOPHILOD_SHM_NAME);
+	fd = shm_open(LOPHILOD_SHM_NAME, O_RDWR | O_CREAT | O_EXCL, 0666);
+	if(fd < 0) {
+		perror("shm_open");
+		return -1;
+	}
+	fchmod(fd, 0666);
+	if(ftruncate(fd, sizeof(struct lophilod_shm)) < 0) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+	shm = mmap(NULL, sizeof(struct lophilod_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(shm == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	shm->magic = LOPHILOD_MAGIC;
+	shm->version = LOPHILOD_VERSION;
+	atomic_store(&shm->daemon, getpid());
+	return 0;
+}
+
+static void reset_slot(struct lophilod_slot *slot)
+{
+	atomic_store(&slot->req_ring.head, 0);
+	atomic_store(&slot->req_ring.tail, 0);
+	atomic_store(&slot->resp_ring.head, 0);
+	atomic_store(&slot->resp_ring.tail, 0);
+	slot->owner = 0;
+	atomic_store(&slot->state, LOPHILOD_SLOT_FREE);
+}
+
+/* Free the slots of clients that detached or died */
+static void reap_slots(int check_owners)
+{
+	struct lophilod_slot *slot;
+	int i;
+
+	for(i = 0; i < LOPHILOD_MAX_CLIENTS; i++) {
+		slot = &shm->slots[i];
+		if(check_owners && atomic_load(&slot->state) == LOPHILOD_SLOT_BUSY &&
+		   slot->owner && kill(slot->owner, 0) < 0 && errno == ESRCH)
+			atomic_store(&slot->state, LOPHILOD_SLOT_DIRTY);
+		if(atomic_load(&slot->state) == LOPHILOD_SLOT_DIRTY)
+			reset_slot(slot);
+	}
+}
+
+/*
+ * Move pending requests into the batch, never more per client than its
+ * response ring can take.
+ */
+static int collect(void)
+{
+	struct lophilod_slot *slot;
+	uint32_t head, tail, room;
+	int i, n = 0;
+
+	for(i = 0; i < LOPHILOD_MAX_CLIENTS; i++) {
+		slot = &shm->slots[i];
+		if(atomic_load_explicit(&slot->state, memory_order_acquire) != LOPHILOD_SLOT_BUSY)
+			continue;
+		head = atomic_load_explicit(&slot->req_ring.head, memory_order_acquire);
+		tail = atomic_load_explicit(&slot->req_ring.tail, memory_order_relaxed);
+		room = LOPHILOD_RING_SIZE -
+			(atomic_load_explicit(&slot->resp_ring.head, memory_order_relaxed) -
+			 atomic_load_explicit(&slot->resp_ring.tail, memory_order_acquire));
+		for(; tail != head && room; tail++, room--) {
+			batch[n].slot = slot;
+			batch[n].req = slot->req[tail % LOPHILOD_RING_SIZE];
+			n++;
+		}
+		atomic_store_explicit(&slot->req_ring.tail, tail, memory_order_release);
+	}
+	return n;
+}
+
+static int valid(const struct lophilod_request *req)
+{
+	uint32_t bytes = req->width / 8;
+
+	return req->window <= LOPHILO_WINDOW_MOD &&
+		(req->width == 8 || req->width == 16 || req->width == 32) &&
+		(req->op <= LOPHILO_OP_TGL || req->op == LOPHILOD_OP_READ) &&
+		req->offset % bytes == 0 &&
+		req->offset < WINDOW_SIZE &&
+		bytes <= WINDOW_SIZE - req->offset;
+}
+
+static uint32_t key_of(const struct lophilod_request *req)
+{
+	return ((uint32_t) req->window << 24 | (uint32_t) req->width << 16 | req->offset) + 1;
+}
+
+/* Record a full write; 0 if a higher-priority client already wrote the register */
+static int claim_write(const struct pending *p)
+{
+	uint32_t key = key_of(&p->req);
+	uint32_t i = (key * 2654435761u) % WRITERS_SIZE;
+
+	while(writers[i].key && writers[i].key != key)
+		i = (i + 1) % WRITERS_SIZE;
+	if(writers[i].key && writers[i].slot != p->slot &&
+	   writers[i].priority > p->slot->priority)
+		return 0;
+	writers[i].key = key;
+	writers[i].priority = p->slot->priority;
+	writers[i].slot = p->slot;
+	return 1;
+}
+
+static void apply(int n)
+{
+	struct pending *p;
+	uint32_t cur_key = 0, value = 0;
+	int i, loaded = 0, dirty = 0;
+	struct pending *last = NULL;	/* the request that last changed value */
+
+	memset(writers, 0, sizeof(writers));
+	for(i = 0; i < n; i++) {
+		p = &batch[i];
+		p->resp.seq = p->req.seq;
+		p->resp.status = 0;
+		if(!valid(&p->req)) {
+			p->resp.status = -EINVAL;
+			p->resp.value = 0;
+			continue;
+		}
+
+		if(key_of(&p->req) != cur_key) {
+			if(dirty)
+				flush_reg(last, value);
+			cur_key = key_of(&p->req);
+			loaded = dirty = 0;
+		}
+		if(!loaded && p->req.op != LOPHILO_OP_WRITE) {
+			value = reg_read(p->req.window, p->req.offset, p->req.width);
+			loaded = 1;
+		}
+
+		switch(p->req.op) {
+			case LOPHILO_OP_WRITE:
+				if(!claim_write(p)) {
+					p->resp.status = LOPHILOD_SUPERSEDED;
+					if(!loaded) {
+						value = reg_read(p->req.window, p->req.offset, p->req.width);
+						loaded = 1;
+					}
+					break;
+				}
+				value = p->req.value;
+				loaded = dirty = 1;
+				last = p;
+				break;
+			case LOPHILO_OP_SET:
+				value |= p->req.value;
+				dirty = 1;
+				last = p;
+				break;
+			case LOPHILO_OP_CLR:
+				value &= ~p->req.value;
+				dirty = 1;
+				last = p;
+				break;
+			case LOPHILO_OP_TGL:
+				value ^= p->req.value;
+				dirty = 1;
+				last = p;
+				break;
+			default:
+				break;
+		}
+		p->resp.value = value;
+	}
+	if(dirty)
+		flush_reg(last, value);
+}
+
+/* Responses go out after the batch reached the hardware */
+static void respond(int n)
+{
+	struct lophilod_slot *slot;
+	uint32_t head;
+	int i;
+
+	for(i = 0; i < n; i++) {
+		slot = batch[i].slot;
+		head = atomic_load_explicit(&slot->resp_ring.head, memory_order_relaxed);
+		slot->resp[head % LOPHILOD_RING_SIZE] = batch[i].resp;
+		atomic_store_explicit(&slot->resp_ring.head, head + 1, memory_order_release);
+	}
+	for(i = 0; i < LOPHILOD_MAX_CLIENTS; i++) {
+		slot = &shm->slots[i];
+		if(atomic_load(&slot->resp_ring.sleeping))
+			lophilod_futex_wake(&slot->resp_ring.head);
+	}
+}
+
+static void sleep_on_doorbell(uint32_t doorbell)
+{
+	struct timespec timeout = {
+		.tv_sec = REAP_INTERVAL_MS / 1000,
+		.tv_nsec = (REAP_INTERVAL_MS % 1000) * 1000000,
+	};
+
+	syscall(SYS_futex, &shm->doorbell, FUTEX_WAIT, doorbell, &timeout, NULL, 0);
+}
+
+int main(int argc, char* argv[])
+{
+	const char *dir = "/sys/kernel/debug/lophilo", *base;
+	int simulate = 0;
+	int i, n, spin = 0;
+	uint32_t doorbell;
+
+	for(i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "-s"))
+			simulate = 1;
+		else if(!strcmp(argv[i], "-t") && i + 1 < argc) {
+			trace = fopen(argv[++i], "ab");
+			if(!trace) {
+				perror(argv[i]);
+				return 1;
+			}
+		} else
+			dir = argv[i];
+	}
+	// records name the board like lophilo_replay does: lophilo, lophilo1, ...
+	base = strrchr(dir, '/') ? strrchr(dir, '/') + 1 : dir;
+	if(!strncmp(base, "lophilo", 7))
+		trace_board = atoi(base + 7);
+
+	if(map_window(dir, "sysmem", simulate, &windows[LOPHILO_WINDOW_SYS]) ||
+	   map_window(dir, "modmem", simulate, &windows[LOPHILO_WINDOW_MOD]))
+		return 1;
+	if(create_shm())
+		return 1;
+
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+
+	while(!stopped) {
+		reap_slots(0);
+		n = collect();
+		if(n) {
+			apply(n);
+			respond(n);
+			stat_requests += n;
+			stat_batches++;
+			spin = 0;
+			continue;
+		}
+		if(++spin < lophilod_spin_limit())
+			continue;
+
+		// announce the sleep before the last look at the rings so a
+		// client queuing in between either is seen or rings the doorbell
+		doorbell = atomic_load(&shm->doorbell);
+		atomic_store(&shm->sleeping, 1);
+		n = collect();
+		if(n) {
+			atomic_store(&shm->sleeping, 0);
+			apply(n);
+			respond(n);
+			stat_requests += n;
+			stat_batches++;
+			spin = 0;
+			continue;
+		}
+		sleep_on_doorbell(doorbell);
+		atomic_store(&shm->sleeping, 0);
+		reap_slots(1);
+		spin = 0;
+	}
+
+	atomic_store(&shm->daemon, 0);
+	for(i = 0; i < LOPHILOD_MAX_CLIENTS; i++)
+		lophilod_futex_wake(&shm->slots[i].resp_ring.head);
+	shm_unlink(LOPHILOD_SHM_NAME);
+	if(trace)
+		fclose(trace);
+
+	fprintf(stderr, "lophilod: %llu requests in %llu batches, %llu bus reads, %llu bus writes\n",
+		stat_requests, stat_batches, stat_reads, stat_writes);
+	return 0;
+}
@@ -0,0 +1,294 @@
+/*
+ * Shared-memory protocol and client API of lophilod, the daemon that owns
+ * the Lophilo register mappings on behalf of every other process.
+ *
+ * Copyright 2012 Lophilo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Each client claims a slot holding two single-producer/single-consumer
+ * rings: requests (client -> daemon) and responses (daemon -> client).
+ * On SMP both sides busy-poll for a short while and then sleep on a futex,
+ * so an active client sees sub-microsecond round trips without an idle
+ * daemon burning a CPU. On a uniprocessor spinning only delays the peer,
+ * so they sleep right away.
+ *
+ *	struct lophilod_client client;
+ *	uint32_t value;
+ *
+ *	lophilod_attach(&client, 0);
+ *	lophilod_call(&client, LOPHILO_WINDOW_SYS, LOPHILO_OP_SET, 32, 0x200, 0x3, &value);
+ *	lophilod_detach(&client);
+ */
+#ifndef LOPHILOD_H
+#define LOPHILOD_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lophilo.h"
+
+#define LOPHILOD_SHM_NAME	"/lophilod"
+#define LOPHILOD_MAGIC		0x4c4f5048	/* LOPH */
+#define LOPHILOD_VERSION	1
+#define LOPHILOD_MAX_CLIENTS	16
+#define LOPHILOD_RING_SIZE	64		/* power of two */
+#define LOPHILOD_SPIN		2000		/* polls before sleeping (SMP only) */
+#define LOPHILOD_CHECK_MS	100		/* clients look for a dead daemon this often */
+
+#define LOPHILOD_OP_READ	0x80		/* besides LOPHILO_OP_* */
+
+/* status of a request that lost to a higher-priority write in its batch */
+#define LOPHILOD_SUPERSEDED	1
+
+/* slot states; the daemon resets the rings of a DIRTY slot and frees it */
+#define LOPHILOD_SLOT_FREE	0
+#define LOPHILOD_SLOT_BUSY	1
+#define LOPHILOD_SLOT_DIRTY	2
+
+struct lophilod_request {
+	uint32_t seq;
+	uint32_t offset;
+	uint32_t value;
+	uint8_t window;		/* LOPHILO_WINDOW_* */
+	uint8_t width;		/* 8, 16 or 32 */
+	uint8_t op;		/* LOPHILO_OP_* or LOPHILOD_OP_READ */
+	uint8_t reserved;
+};
+
+struct lophilod_response {
+	uint32_t seq;
+	uint32_t value;		/* register value after the request */
+	int32_t status;		/* 0, -errno or LOPHILOD_SUPERSEDED */
+};
+
+/* head and tail on their own cache lines so producer and consumer don't share one */
+struct lophilod_ring {
+	_Atomic uint32_t head;
+	_Atomic uint32_t sleeping;	/* consumer waits on head */
+	char pad0[56];
+	_Atomic uint32_t tail;
+	char pad1[60];
+};
+
+struct lophilod_slot {
+	_Atomic uint32_t state;		/* LOPHILOD_SLOT_* */
+	int32_t owner;			/* pid of the client */
+	uint32_t priority;		/* higher wins conflicting writes */
+	char pad[52];
+	struct lophilod_ring req_ring;
+	struct lophilod_request req[LOPHILOD_RING_SIZE];
+	struct lophilod_ring resp_ring;
+	struct lophilod_response resp[LOPHILOD_RING_SIZE];
+};
+
+struct lophilod_shm {
+	uint32_t magic;
+	uint32_t version;
+	_Atomic int32_t daemon;		/* daemon pid, 0 once it exits */
+	_Atomic uint32_t doorbell;	/* bumped by clients after queuing */
+	_Atomic uint32_t sleeping;	/* daemon waits on doorbell */
+	char pad[44];
+	struct lophilod_slot slots[LOPHILOD_MAX_CLIENTS];
+};
+
+static inline int lophilod_futex_wait(_Atomic uint32_t *addr, uint32_t value,
+	const struct timespec *timeout)
+{
+	return syscall(SYS_futex, addr, FUTEX_WAIT, value, timeout, NULL, 0);
+}
+
+/* The daemon clears its pid on a clean exit; a crash leaves it stale */
+static inline int lophilod_daemon_alive(struct lophilod_shm *shm)
+{
+	int32_t pid = atomic_load(&shm->daemon);
+
+	return pid && !(kill(pid, 0) < 0 && errno == ESRCH);
+}
+
+static inline void lophilod_futex_wake(_Atomic uint32_t *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static inline int lophilod_spin_limit(void)
+{
+	static int limit = -1;
+
+	if(limit < 0)
+		limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? LOPHILOD_SPIN : 0;
+	return limit;
+}
+
+struct lophilod_client {
+	struct lophilod_shm *shm;
+	struct lophilod_slot *slot;
+	uint32_t seq;
+	uint32_t staged;	/* request ring head once lophilod_flush publishes */
+};
+
+/* Map the daemon's shared memory and claim a free slot */
+static inline int lophilod_attach(struct lophilod_client *client, uint32_t priority)
+{
+	struct lophilod_slot *slot;
+	uint32_t free_state;
+	int fd, i;
+
+	fd = shm_open(LOPHILOD_SHM_NAME, O_RDWR, 0);
+	if(fd < 0)
+		return -errno;
+	client->shm = mmap(NULL, sizeof(struct lophilod_shm), PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	close(fd);
+	if(client->shm == MAP_FAILED)
+		return -errno;
+	if(client->shm->magic != LOPHILOD_MAGIC ||
+	   client->shm->version != LOPHILOD_VERSION ||
+	   !lophilod_daemon_alive(client->shm)) {
+		munmap(client->shm, sizeof(struct lophilod_shm));
+		return -ENODEV;
+	}
+
+	for(i = 0; i < LOPHILOD_MAX_CLIENTS; i++) {
+		slot = &client->shm->slots[i];
+		free_state = LOPHILOD_SLOT_FREE;
+		if(atomic_compare_exchange_strong(&slot->state, &free_state, LOPHILOD_SLOT_BUSY)) {
+			slot->owner = getpid();
+			slot->priority = priority;
+			client->slot = slot;
+			client->seq = 0;
+			client->staged = atomic_load(&slot->req_ring.head);
+			return 0;
+		}
+	}
+	munmap(client->shm, sizeof(struct lophilod_shm));
+	return -EBUSY;
+}
+
+static inline void lophilod_detach(struct lophilod_client *client)
+{
+	atomic_store(&client->slot->state, LOPHILOD_SLOT_DIRTY);
+	munmap(client->shm, sizeof(struct lophilod_shm));
+}
+
+/*
+ * Stage one request without handing it to the daemon yet; returns its
+ * sequence number or -EAGAIN when the ring is full. Stage several, then
+ * lophilod_flush them and collect their responses with lophilod_wait, to
+ * have the daemon apply them as one batch.
+ */
+static inline int64_t lophilod_queue(struct lophilod_client *client,
+	uint8_t window, uint8_t op, uint8_t width, uint32_t offset, uint32_t value)
+{
+	struct lophilod_ring *ring = &client->slot->req_ring;
+	struct lophilod_request *req;
+	uint32_t head = client->staged;
+
+	if(head - atomic_load_explicit(&ring->tail, memory_order_acquire) == LOPHILOD_RING_SIZE)
+		return -EAGAIN;
+
+	req = &client->slot->req[head % LOPHILOD_RING_SIZE];
+	req->seq = ++client->seq;
+	req->offset = offset;
+	req->value = value;
+	req->window = window;
+	req->width = width;
+	req->op = op;
+	req->reserved = 0;
+	client->staged = head + 1;
+	return req->seq;
+}
+
+/* Publish every staged request at once and ring the doorbell */
+static inline void lophilod_flush(struct lophilod_client *client)
+{
+	struct lophilod_ring *ring = &client->slot->req_ring;
+
+	if(atomic_load_explicit(&ring->head, memory_order_relaxed) == client->staged)
+		return;
+	atomic_store_explicit(&ring->head, client->staged, memory_order_release);
+
+	atomic_fetch_add_explicit(&client->shm->doorbell, 1, memory_order_seq_cst);
+	if(atomic_load(&client->shm->sleeping))
+		lophilod_futex_wake(&client->shm->doorbell);
+}
+
+/* Queue one request and hand it to the daemon right away */
+static inline int64_t lophilod_submit(struct lophilod_client *client,
+	uint8_t window, uint8_t op, uint8_t width, uint32_t offset, uint32_t value)
+{
+	int64_t seq = lophilod_queue(client, window, op, width, offset, value);
+
+	if(seq >= 0)
+		lophilod_flush(client);
+	return seq;
+}
+
+/*
+ * Take the next response, spinning briefly before sleeping. Returns
+ * -ENODEV once the daemon is gone, whether it exited or crashed.
+ */
+static inline int lophilod_wait(struct lophilod_client *client, struct lophilod_response *resp)
+{
+	static const struct timespec check = { 0, LOPHILOD_CHECK_MS * 1000000L };
+	struct lophilod_ring *ring = &client->slot->resp_ring;
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	uint32_t head;
+	int spin = 0;
+
+	while((head = atomic_load_explicit(&ring->head, memory_order_acquire)) == tail) {
+		if(!atomic_load(&client->shm->daemon))
+			return -ENODEV;
+		if(++spin < lophilod_spin_limit())
+			continue;
+		atomic_store(&ring->sleeping, 1);
+		if(atomic_load(&ring->head) == tail &&
+		   lophilod_futex_wait(&ring->head, tail, &check) < 0 && errno == ETIMEDOUT &&
+		   !lophilod_daemon_alive(client->shm)) {
+			atomic_store(&ring->sleeping, 0);
+			return -ENODEV;
+		}
+		atomic_store(&ring->sleeping, 0);
+	}
+
+	*resp = client->slot->resp[tail % LOPHILOD_RING_SIZE];
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return 0;
+}
+
+/* Submit one request and wait for its result */
+static inline int lophilod_call(struct lophilod_client *client,
+	uint8_t window, uint8_t op, uint8_t width, uint32_t offset, uint32_t value,
+	uint32_t *result)
+{
+	struct lophilod_response resp;
+	int64_t seq;
+	int ret;
+
+	seq = lophilod_submit(client, window, op, width, offset, value);
+	if(seq < 0)
+		return seq;
+	do {
+		ret = lophilod_wait(client, &resp);
+		if(ret)
+			return ret;
+	} while(resp.seq != (uint32_t) seq);
+	if(result)
+		*result = resp.value;
+	return resp.status;
+}
+
+#endif /* LOPHILOD_H */